@@ -0,0 +1,448 @@
+// Replays resource state request streams through the tracking code without a device.
+// Usage: etna_tracking_bench [--iterations N] [--cache] [--global-image-barriers] [stream files...]
+//
+// Stream file lines (flags and layouts are numeric vulkan values):
+//   image <name> <mips> <layers> <color|depth>
+//   buffer <name> <size>
+//   img <name> <firstMip> <mipCount> <firstLayer> <layerCount> <stages> <access> <layout>
+//   buf <name> <offset> <size> <stages> <access>
+//   discard <name>
+//   flush
+//   submit
+#include <etna/ResourceTracking.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+// Allocations are counted by replacing global operator new
+static uint64_t g_allocations = 0;
+
+#if defined(__GNUC__) && !defined(__clang__)
+// gcc sees free() of memory from operator new after inlining the replacements
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(std::size_t size)
+{
+  g_allocations++;
+  if (void *ptr = std::malloc(size ? size : 1))
+    return ptr;
+  throw std::bad_alloc {};
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { ::operator delete(ptr); }
+
+using namespace etna;
+using namespace etna::tracking;
+
+using Stage = vk::PipelineStageFlagBits2;
+using Access = vk::AccessFlagBits2;
+using Layout = vk::ImageLayout;
+
+struct Op
+{
+  enum class Kind { Image, Buffer, Discard, Flush, Submit };
+
+  Kind kind;
+  uint32_t resource = 0;
+  vk::ImageSubresourceRange range {};
+  ImageSubresState imageState {};
+  vk::DeviceSize offset = 0;
+  vk::DeviceSize size = VK_WHOLE_SIZE;
+  BufferState bufferState {};
+};
+
+struct Stream
+{
+  std::string name;
+  std::vector<ImageResource> images;
+  std::vector<BufferResource> buffers;
+  std::vector<Op> ops;
+
+  uint32_t addImage(uint32_t mips, uint32_t layers, vk::ImageAspectFlags aspect = vk::ImageAspectFlagBits::eColor)
+  {
+    auto id = allocate_resource_id();
+    images.emplace_back(id, vk::Image {(VkImage)(uintptr_t)id}, aspect, mips, layers);
+    return static_cast<uint32_t>(images.size() - 1);
+  }
+
+  uint32_t addBuffer(vk::DeviceSize size)
+  {
+    auto id = allocate_resource_id();
+    buffers.emplace_back(id, vk::Buffer {(VkBuffer)(uintptr_t)id}, size);
+    return static_cast<uint32_t>(buffers.size() - 1);
+  }
+
+  void image(uint32_t idx, uint32_t first_mip, uint32_t mip_count, ImageSubresState state)
+  {
+    ops.push_back(Op {
+      .kind = Op::Kind::Image,
+      .resource = idx,
+      .range = vk::ImageSubresourceRange {
+        .aspectMask = images[idx].aspect,
+        .baseMipLevel = first_mip,
+        .levelCount = mip_count,
+        .baseArrayLayer = 0,
+        .layerCount = images[idx].arrayLayers
+      },
+      .imageState = state
+    });
+  }
+
+  void image(uint32_t idx, ImageSubresState state) { image(idx, 0, images[idx].mipLevels, state); }
+
+  void buffer(uint32_t idx, BufferState state)
+  {
+    ops.push_back(Op {.kind = Op::Kind::Buffer, .resource = idx, .bufferState = state});
+  }
+
+  void flush() { ops.push_back(Op {.kind = Op::Kind::Flush}); }
+  void submit() { ops.push_back(Op {.kind = Op::Kind::Submit}); }
+
+  uint64_t requestsCount() const
+  {
+    uint64_t count = 0;
+    for (auto &op : ops)
+      count += op.kind == Op::Kind::Image || op.kind == Op::Kind::Buffer || op.kind == Op::Kind::Discard;
+    return count;
+  }
+};
+
+static const ImageSubresState COLOR_WRITE {Stage::eColorAttachmentOutput,
+  Access::eColorAttachmentWrite, Layout::eColorAttachmentOptimal};
+static const ImageSubresState DEPTH_WRITE {Stage::eEarlyFragmentTests | Stage::eLateFragmentTests,
+  Access::eDepthStencilAttachmentWrite | Access::eDepthStencilAttachmentRead, Layout::eDepthStencilAttachmentOptimal};
+static const ImageSubresState COMPUTE_SAMPLED {Stage::eComputeShader,
+  Access::eShaderSampledRead, Layout::eShaderReadOnlyOptimal};
+static const ImageSubresState FRAGMENT_SAMPLED {Stage::eFragmentShader,
+  Access::eShaderSampledRead, Layout::eShaderReadOnlyOptimal};
+static const ImageSubresState TRANSFER_SRC {Stage::eTransfer, Access::eTransferRead, Layout::eTransferSrcOptimal};
+static const ImageSubresState TRANSFER_DST {Stage::eTransfer, Access::eTransferWrite, Layout::eTransferDstOptimal};
+
+static Stream deferred_shading_frame()
+{
+  Stream s {};
+  s.name = "deferred shading frame";
+  auto shadowMap = s.addImage(1, 4, vk::ImageAspectFlagBits::eDepth);
+  auto depth = s.addImage(1, 1, vk::ImageAspectFlagBits::eDepth);
+  uint32_t gbuffer[4];
+  for (auto &target : gbuffer)
+    target = s.addImage(1, 1);
+  auto hdr = s.addImage(1, 1);
+  auto backbuffer = s.addImage(1, 1);
+  auto constants = s.addBuffer(64 << 10);
+  auto instances = s.addBuffer(4 << 20);
+
+  const BufferState vertexRead {Stage::eVertexShader, Access::eShaderStorageRead};
+  const BufferState uniformRead {Stage::eVertexShader | Stage::eFragmentShader | Stage::eComputeShader,
+    Access::eUniformRead};
+
+  s.buffer(constants, BufferState {Stage::eTransfer, Access::eTransferWrite});
+  s.flush();
+
+  s.image(shadowMap, DEPTH_WRITE);
+  s.buffer(constants, uniformRead);
+  s.buffer(instances, vertexRead);
+  s.flush();
+
+  for (auto target : gbuffer)
+    s.image(target, COLOR_WRITE);
+  s.image(depth, DEPTH_WRITE);
+  s.buffer(constants, uniformRead);
+  s.buffer(instances, vertexRead);
+  s.flush();
+
+  for (auto target : gbuffer)
+    s.image(target, COMPUTE_SAMPLED);
+  s.image(depth, COMPUTE_SAMPLED);
+  s.image(shadowMap, COMPUTE_SAMPLED);
+  s.buffer(constants, uniformRead);
+  s.image(hdr, ImageSubresState {Stage::eComputeShader, Access::eShaderStorageWrite, Layout::eGeneral});
+  s.flush();
+
+  s.image(hdr, FRAGMENT_SAMPLED);
+  s.image(backbuffer, COLOR_WRITE);
+  s.flush();
+
+  s.image(backbuffer, ImageSubresState {Stage::eNone, Access::eNone, Layout::ePresentSrcKHR});
+  s.flush();
+  s.submit();
+  return s;
+}
+
+static Stream texture_upload()
+{
+  Stream s {};
+  s.name = "1000-texture upload";
+  auto staging = s.addBuffer(256 << 20);
+  std::vector<uint32_t> textures;
+  for (uint32_t i = 0; i < 1000; i++)
+    textures.push_back(s.addImage(1, 1));
+
+  for (auto texture : textures)
+  {
+    s.buffer(staging, BufferState {Stage::eTransfer, Access::eTransferRead});
+    s.image(texture, TRANSFER_DST);
+    s.flush();
+  }
+
+  for (auto texture : textures)
+    s.image(texture, FRAGMENT_SAMPLED);
+  s.flush();
+  s.submit();
+  return s;
+}
+
+static Stream mip_generation()
+{
+  Stream s {};
+  s.name = "mip generation";
+  std::vector<uint32_t> textures;
+  for (uint32_t i = 0; i < 64; i++)
+    textures.push_back(s.addImage(11, 6));
+
+  for (auto texture : textures)
+  {
+    s.image(texture, 0, 1, TRANSFER_DST);
+    s.flush();
+    for (uint32_t mip = 1; mip < 11; mip++)
+    {
+      s.image(texture, mip - 1, 1, TRANSFER_SRC);
+      s.image(texture, mip, 1, TRANSFER_DST);
+      s.flush();
+    }
+    s.image(texture, FRAGMENT_SAMPLED);
+    s.flush();
+  }
+  s.submit();
+  return s;
+}
+
+static bool load_stream(const char *path, Stream &s)
+{
+  std::ifstream file {path};
+  if (!file)
+    return false;
+
+  s.name = path;
+  std::unordered_map<std::string, uint32_t> images, buffers;
+  std::string line;
+  while (std::getline(file, line))
+  {
+    std::istringstream in {line};
+    std::string cmd, name;
+    in >> cmd;
+    if (cmd.empty() || cmd[0] == '#')
+      continue;
+
+    if (cmd == "image")
+    {
+      uint32_t mips = 1, layers = 1;
+      std::string aspect;
+      in >> name >> mips >> layers >> aspect;
+      images[name] = s.addImage(mips, layers,
+        aspect == "depth"? vk::ImageAspectFlagBits::eDepth : vk::ImageAspectFlagBits::eColor);
+    }
+    else if (cmd == "buffer")
+    {
+      vk::DeviceSize size = 0;
+      in >> name >> size;
+      buffers[name] = s.addBuffer(size);
+    }
+    else if (cmd == "img")
+    {
+      uint32_t firstMip, mipCount, firstLayer, layerCount, layout;
+      uint64_t stages, access;
+      in >> name >> firstMip >> mipCount >> firstLayer >> layerCount >> stages >> access >> layout;
+      auto it = images.find(name);
+      if (!in || it == images.end())
+        return false;
+      s.ops.push_back(Op {
+        .kind = Op::Kind::Image,
+        .resource = it->second,
+        .range = vk::ImageSubresourceRange {
+          .aspectMask = s.images[it->second].aspect,
+          .baseMipLevel = firstMip,
+          .levelCount = mipCount,
+          .baseArrayLayer = firstLayer,
+          .layerCount = layerCount
+        },
+        .imageState = ImageSubresState {vk::PipelineStageFlags2(stages), vk::AccessFlags2(access),
+          static_cast<vk::ImageLayout>(layout)}
+      });
+    }
+    else if (cmd == "buf")
+    {
+      vk::DeviceSize offset, size;
+      uint64_t stages, access;
+      in >> name >> offset >> size >> stages >> access;
+      auto it = buffers.find(name);
+      if (!in || it == buffers.end())
+        return false;
+      s.ops.push_back(Op {
+        .kind = Op::Kind::Buffer,
+        .resource = it->second,
+        .offset = offset,
+        .size = size,
+        .bufferState = BufferState {vk::PipelineStageFlags2(stages), vk::AccessFlags2(access)}
+      });
+    }
+    else if (cmd == "discard")
+    {
+      in >> name;
+      auto it = images.find(name);
+      if (it == images.end())
+        return false;
+      auto &image = s.images[it->second];
+      s.ops.push_back(Op {
+        .kind = Op::Kind::Discard,
+        .resource = it->second,
+        .range = vk::ImageSubresourceRange {
+          .aspectMask = image.aspect,
+          .baseMipLevel = 0,
+          .levelCount = image.mipLevels,
+          .baseArrayLayer = 0,
+          .layerCount = image.arrayLayers
+        }
+      });
+    }
+    else if (cmd == "flush")
+      s.flush();
+    else if (cmd == "submit")
+      s.submit();
+    else
+      return false;
+  }
+
+  if (s.ops.empty() || s.ops.back().kind != Op::Kind::Submit)
+    s.submit();
+  return true;
+}
+
+struct Options
+{
+  uint32_t iterations = 100;
+  bool barrierCaching = false;
+  bool globalImageBarriers = false;
+};
+
+static uint64_t count_barriers(const CmdBarrier &barrier)
+{
+  return barrier.memoryBarrier.has_value() + barrier.imageBarriers.size()
+    + barrier.bufferBarriers.size() + barrier.waitEvents.size();
+}
+
+// replays the stream once, returns barriers emitted
+static uint64_t replay(const Stream &s, QueueTrackingState &queue, CmdBufferTrackingState &cmd, CmdBarrier &barrier)
+{
+  uint64_t barriers = 0;
+  for (auto &op : s.ops)
+  {
+    switch (op.kind)
+    {
+    case Op::Kind::Image:
+      cmd.requestState(s.images[op.resource], op.range, op.imageState);
+      break;
+    case Op::Kind::Buffer:
+      cmd.requestState(s.buffers[op.resource], op.offset, op.size, op.bufferState);
+      break;
+    case Op::Kind::Discard:
+      cmd.discard(s.images[op.resource], op.range);
+      break;
+    case Op::Kind::Flush:
+      cmd.flushBarrier(barrier);
+      barriers += count_barriers(barrier);
+      barrier.clear();
+      break;
+    case Op::Kind::Submit:
+      cmd.flushBarrier(barrier);
+      barriers += count_barriers(barrier);
+      barrier.clear();
+      queue.onSubmit(cmd);
+      queue.onWait();
+      cmd.clearAll();
+      break;
+    }
+  }
+  return barriers;
+}
+
+static void run(const Stream &s, const Options &options)
+{
+  QueueTrackingState queue;
+  CmdBufferTrackingState cmd;
+  CmdBarrier barrier;
+  cmd.setQueueState(&queue);
+  cmd.setBarrierCaching(options.barrierCaching);
+  cmd.setGlobalImageBarriers(options.globalImageBarriers);
+
+  // warm up: resources get into queue states, containers reach their capacity
+  replay(s, queue, cmd, barrier);
+
+  uint64_t barriers = 0;
+  uint64_t allocationsBefore = g_allocations;
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < options.iterations; i++)
+    barriers += replay(s, queue, cmd, barrier);
+  auto end = std::chrono::steady_clock::now();
+  uint64_t allocations = g_allocations - allocationsBefore;
+
+  double ns = std::chrono::duration<double, std::nano>(end - start).count();
+  uint64_t requests = s.requestsCount() * options.iterations;
+  std::printf("%-24s %8llu requests  %8.1f ns/request  %8.1f barriers/iter  %8.1f allocs/iter",
+    s.name.c_str(), static_cast<unsigned long long>(s.requestsCount()), ns / double(requests),
+    double(barriers) / options.iterations, double(allocations) / options.iterations);
+  if (options.barrierCaching)
+  {
+    auto &stats = cmd.getBarrierCacheStats();
+    std::printf("  cache %llu/%llu hits", static_cast<unsigned long long>(stats.hits),
+      static_cast<unsigned long long>(stats.hits + stats.misses));
+  }
+  std::printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+  Options options {};
+  std::vector<Stream> streams;
+
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--iterations" && i + 1 < argc)
+      options.iterations = std::max(1, std::atoi(argv[++i]));
+    else if (arg == "--cache")
+      options.barrierCaching = true;
+    else if (arg == "--global-image-barriers")
+      options.globalImageBarriers = true;
+    else
+    {
+      Stream s {};
+      if (!load_stream(argv[i], s))
+      {
+        std::fprintf(stderr, "failed to load request stream %s\n", argv[i]);
+        return 1;
+      }
+      streams.push_back(std::move(s));
+    }
+  }
+
+  if (streams.empty())
+  {
+    streams.push_back(deferred_shading_frame());
+    streams.push_back(texture_upload());
+    streams.push_back(mip_generation());
+  }
+
+  for (auto &s : streams)
+    run(s, options);
+  return 0;
+}
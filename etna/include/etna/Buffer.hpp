@@ -3,6 +3,7 @@
 #define ETNA_BUFFER_HPP_INCLUDED
 
 #include <etna/Vulkan.hpp>
+#include <etna/Forward.hpp>
 #include <vk_mem_alloc.h>
 
 
@@ -34,6 +35,7 @@ public:
   Buffer& operator=(Buffer&&) noexcept;
 
   [[nodiscard]] vk::Buffer get() const { return buffer; }
+  [[nodiscard]] ResourceId getId() const { return id; }
   [[nodiscard]] std::byte* data() { return mapped; }
 
   BufferBinding genBinding(vk::DeviceSize offset = 0, vk::DeviceSize range = VK_WHOLE_SIZE) const;
@@ -51,6 +53,7 @@ private:
 
   VmaAllocation allocation{};
   vk::Buffer buffer{};
+  ResourceId id {INVALID_RESOURCE_ID};
   std::byte* mapped{};
   std::size_t size {0ull};
 };
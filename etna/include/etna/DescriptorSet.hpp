@@ -3,6 +3,7 @@
 #define ETNA_DESCRIPTOR_SET_HPP_INCLUDED
 
 #include <variant>
+#include <span>
 #include <etna/Vulkan.hpp>
 #include "DescriptorSetLayout.hpp"
 #include "BindingItems.hpp"
@@ -57,7 +58,11 @@ namespace etna
       return bindings;
     }
 
-    void requestStates(tracking::CmdBufferTrackingState &state) const;
+    // binding_stages narrows stages of each binding to shaders of the bound pipeline that use it,
+    // binding_storage_access narrows storage accesses to the ones the pipeline may perform
+    void requestStates(tracking::CmdBufferTrackingState &state,
+      std::span<const vk::ShaderStageFlags> binding_stages = {},
+      std::span<const vk::AccessFlags2> binding_storage_access = {}) const;
   
   private:
     uint64_t generation {};
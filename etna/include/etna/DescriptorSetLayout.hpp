@@ -22,7 +22,9 @@ namespace etna
   struct DescriptorSetInfo
   {
     void parseShader(vk::ShaderStageFlagBits stage, const SpvReflectDescriptorSet &spv);
-    void addResource(const vk::DescriptorSetLayoutBinding &binding);
+    // a binding is read-only/write-only only if it is so in every shader stage
+    void addResource(const vk::DescriptorSetLayoutBinding &binding,
+      bool non_writable = false, bool non_readable = false);
     void merge(const DescriptorSetInfo &info);
 
     bool operator==(const DescriptorSetInfo &rhs) const;
@@ -42,16 +44,25 @@ namespace etna
       return *bindings.at(binding);
     }
 
+    // NonWritable/NonReadable SPIR-V decorations of storage resources. Not a part of the layout,
+    // programs with the same layout may use a binding differently, see ShaderProgramInfo::getBindingStorageAccess
+    bool isNonWritable(uint32_t binding) const { return nonWritable.test(binding); }
+    bool isNonReadable(uint32_t binding) const { return nonReadable.test(binding); }
+
     void patchBinding(vk::DescriptorSetLayoutBinding info)
     {
       ETNA_ASSERT(info.binding < MAX_DESCRIPTOR_BINDINGS);
       maxUsedBinding = std::max(maxUsedBinding, info.binding + 1);
       bindings[info.binding] = info;
+      nonWritable.reset(info.binding);
+      nonReadable.reset(info.binding);
     }
 
   private:
     uint32_t maxUsedBinding = 0;
     std::array<std::optional<vk::DescriptorSetLayoutBinding>, MAX_DESCRIPTOR_BINDINGS> bindings {};
+    std::bitset<MAX_DESCRIPTOR_BINDINGS> nonWritable {};
+    std::bitset<MAX_DESCRIPTOR_BINDINGS> nonReadable {};
 
     friend DescriptorSetLayoutHash;
   };
@@ -33,6 +33,10 @@ namespace etna
     std::optional<uint32_t> physicalDeviceIndexOverride = std::nullopt;
 
     uint32_t numFramesInFlight = 2;
+
+    // Images are kept in fewer layouts, so barriers between passes don't transition them.
+    // Layouts passed to etna are mapped, raw Vulkan commands should use the same layouts
+    LayoutPolicy layoutPolicy = LayoutPolicy::Exact;
   };
 
   bool is_initilized();
@@ -15,6 +15,30 @@ struct ShaderProgramManager;
 using ShaderProgramId = std::uint32_t;
 inline constexpr ShaderProgramId INVALID_SHADER_PROGRAM_ID = static_cast<PipelineId>(-1);
 
+// Unique id of an image or a buffer. Low 32 bits are a slot index that is recycled
+// after the resource is destroyed, high 32 bits are a generation that is never reused.
+using ResourceId = std::uint64_t;
+inline constexpr ResourceId INVALID_RESOURCE_ID = 0;
+
+// Compute and transfer queues are queues of dedicated families if the device has them,
+// otherwise they are the universal queue
+enum class QueueType : std::uint32_t
+{
+  Universal,
+  Compute,
+  Transfer
+};
+inline constexpr std::uint32_t QUEUE_TYPE_COUNT = 3;
+
+// Maps requested image layouts onto a smaller set, so more barriers are plain
+// dependencies instead of layout transitions
+enum class LayoutPolicy : std::uint32_t
+{
+  Exact, // layouts are used as requested
+  Unified, // attachment layouts become eAttachmentOptimal, read-only ones eReadOnlyOptimal
+  General // everything except presentation layouts becomes eGeneral
+};
+
 }
 
 
@@ -13,10 +13,35 @@
 
 #include <vk_mem_alloc.h>
 #include <optional>
+#include <array>
 
 
 namespace etna
 {
+  // One queue per used queue family. Every queue tracks states of resources it owns
+  struct QueueContext
+  {
+    vk::Queue queue {};
+    uint32_t familyIdx {};
+    QueueTrackingState tracking;
+
+    // signaled by ownership release submits, acquiring submits of other queues wait for it.
+    // Also signaled by submits with prologues to know when internal command buffers are free
+    vk::UniqueSemaphore timeline {};
+    uint64_t timelineValue = 0;
+    vk::UniqueCommandPool internalPool {};
+    // command buffers with release or prologue barriers and timeline values after which they are free
+    std::vector<std::pair<vk::UniqueCommandBuffer, uint64_t>> internalCmds {};
+
+    // records and submits release barriers, returns timeline value to wait for
+    uint64_t submitRelease(const tracking::OwnershipRelease &release);
+    // records barriers into a free internal command buffer. The submit which executes it
+    // must signal the timeline with the returned value
+    std::pair<vk::CommandBuffer, uint64_t> recordPrologue(tracking::CmdBarrier &barrier);
+    // begins a free internal command buffer, it is free again after the next timeline value
+    vk::CommandBuffer beginInternalCmd();
+  };
+
   class GlobalContext
   {
     friend void initialize(const struct InitParams &);
@@ -31,9 +56,12 @@ namespace etna
     vk::Device getDevice() const { return vkDevice.get(); }
     vk::PhysicalDevice getPhysicalDevice() const { return vkPhysDevice; }
     vk::Instance getInstance() const { return vkInstance.get(); }
-    vk::Queue getQueue() const { return universalQueue; }
-    uint32_t getQueueFamilyIdx() const { return universalQueueFamilyIdx; }
+    vk::Queue getQueue(QueueType type = QueueType::Universal) const { return getQueueContext(type).queue; }
+    uint32_t getQueueFamilyIdx(QueueType type = QueueType::Universal) const { return getQueueContext(type).familyIdx; }
     uint32_t getNumFramesInFlight() const { return numFramesInFlight; }
+    LayoutPolicy getLayoutPolicy() const { return layoutPolicy; }
+    // VK_KHR_draw_indirect_count is enabled, count variants of indirect draws can be used
+    bool supportsDrawIndirectCount() const { return drawIndirectCount; }
     
     ShaderProgramManager &getShaderManager() { return shaderPrograms; }
     PipelineManager &getPipelineManager() { return pipelineManager.value(); }
@@ -44,7 +72,14 @@ namespace etna
     GlobalContext &operator=(const GlobalContext&) = delete;
     ~GlobalContext();
 
-    QueueTrackingState &getQueueTrackingState();
+    QueueTrackingState &getQueueTrackingState(QueueType type = QueueType::Universal);
+
+    QueueContext &getQueueContext(QueueType type) { return queues[queueIndices[static_cast<uint32_t>(type)]]; }
+    const QueueContext &getQueueContext(QueueType type) const { return queues[queueIndices[static_cast<uint32_t>(type)]]; }
+    QueueContext &getQueueContext(const QueueTrackingState &tracking);
+
+    // drops resource state from all queues
+    void onResourceDeletion(ResourceId id);
     
   private:
     vk::DynamicLoader dl;
@@ -53,10 +88,9 @@ namespace etna
     vk::PhysicalDevice vkPhysDevice {};
     vk::UniqueDevice vkDevice {};
 
-    // We use a single queue for all purposes.
-    // Async compute/transfer is too complicated for demos.
-    vk::Queue universalQueue {};
-    uint32_t universalQueueFamilyIdx {};
+    // Universal queue is always first. Queue types without a dedicated family use it
+    std::vector<QueueContext> queues;
+    std::array<uint32_t, QUEUE_TYPE_COUNT> queueIndices {};
 
     std::unique_ptr<VmaAllocator_T, void(*)(VmaAllocator)> vmaAllocator{nullptr, nullptr};
 
@@ -64,12 +98,12 @@ namespace etna
     ShaderProgramManager shaderPrograms {};
 
     uint32_t numFramesInFlight {};
+    LayoutPolicy layoutPolicy {};
+    bool drawIndirectCount = false;
 
     // Optionals for late init
     std::optional<PipelineManager> pipelineManager;
     std::optional<DynamicDescriptorPool> descriptorPool;
-
-    QueueTrackingState queueTracking;
   };
 
   GlobalContext &get_context();
@@ -3,6 +3,7 @@
 #define ETNA_IMAGE_HPP_INCLUDED
 
 #include <etna/Vulkan.hpp>
+#include <etna/Forward.hpp>
 #include <vk_mem_alloc.h>
 
 
@@ -90,6 +91,7 @@ public:
   Image& operator=(Image&&) noexcept;
 
   [[nodiscard]] vk::Image get() const { return image; }
+  [[nodiscard]] ResourceId getId() const { return id; }
 
   ~Image();
   void reset();
@@ -159,6 +161,7 @@ private:
 
   VmaAllocation allocation{};
   vk::Image image{}; //todo: add extent, layers, mips
+  ResourceId id {INVALID_RESOURCE_ID};
   ImageCreateInfo imageInfo {};
 };
 
@@ -0,0 +1,93 @@
+#pragma once
+#ifndef ETNA_RENDER_COMMAND_STREAM_HPP_INCLUDED
+#define ETNA_RENDER_COMMAND_STREAM_HPP_INCLUDED
+
+#include <etna/Vulkan.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+namespace etna
+{
+
+// Commands of a render pass, recorded before the barriers for the pass are known.
+// They are packed into one byte arena and replayed into the primary command buffer
+// right after vkCmdBeginRendering. clear() keeps the capacity, so a stream reused
+// every frame stops allocating after the first frames.
+struct RenderCommandStream
+{
+  void bindPipeline(vk::PipelineBindPoint bind_point, vk::Pipeline pipeline);
+  void bindDescriptorSet(vk::PipelineBindPoint bind_point, vk::PipelineLayout layout, uint32_t set_index,
+    vk::DescriptorSet set, std::span<const uint32_t> dynamic_offsets);
+  void pushConstants(vk::PipelineLayout layout, vk::ShaderStageFlags stages,
+    uint32_t offset, uint32_t size, const void *data);
+  void bindVertexBuffer(uint32_t binding_index, vk::Buffer buffer, vk::DeviceSize offset);
+  void bindIndexBuffer(vk::Buffer buffer, vk::DeviceSize offset, vk::IndexType type);
+  void draw(uint32_t vertex_count, uint32_t instance_count, uint32_t first_vertex, uint32_t first_instance);
+  void drawIndexed(uint32_t index_count, uint32_t instance_count,
+    uint32_t first_index, int32_t vertex_offset, uint32_t first_instance);
+  void drawIndirect(vk::Buffer buffer, vk::DeviceSize offset, uint32_t draw_count, uint32_t stride);
+  void drawIndexedIndirect(vk::Buffer buffer, vk::DeviceSize offset, uint32_t draw_count, uint32_t stride);
+  void drawIndirectCount(vk::Buffer buffer, vk::DeviceSize offset, vk::Buffer count_buffer,
+    vk::DeviceSize count_offset, uint32_t max_draw_count, uint32_t stride);
+  void drawIndexedIndirectCount(vk::Buffer buffer, vk::DeviceSize offset, vk::Buffer count_buffer,
+    vk::DeviceSize count_offset, uint32_t max_draw_count, uint32_t stride);
+  void setViewport(uint32_t first_viewport, std::span<const vk::Viewport> viewports);
+  void setScissor(uint32_t first_scissor, std::span<const vk::Rect2D> scissors);
+
+  // with state_only draws are skipped, only binds, push constants and dynamic state are replayed
+  void replay(vk::CommandBuffer cmd, bool state_only = false) const;
+
+  void clear() { arena.clear(); }
+  bool empty() const { return arena.empty(); }
+  size_t sizeBytes() const { return arena.size(); }
+
+private:
+  enum class Op : uint32_t
+  {
+    BindPipeline,
+    BindDescriptorSet,
+    PushConstants,
+    BindVertexBuffer,
+    BindIndexBuffer,
+    Draw,
+    DrawIndexed,
+    DrawIndirect,
+    DrawIndexedIndirect,
+    DrawIndirectCount,
+    DrawIndexedIndirectCount,
+    SetViewport,
+    SetScissor
+  };
+
+  // every command is a header, a fixed size struct and optional trailing data,
+  // padded to 8 bytes so handles in the structs stay aligned
+  struct Header
+  {
+    Op op;
+    uint32_t size; // of the struct and trailing data with padding
+  };
+
+  template <typename T>
+  void write(Op op, const T &command, const void *trailing = nullptr, size_t trailing_size = 0)
+  {
+    static_assert(std::is_trivially_copyable_v<T> && alignof(T) <= 8 && sizeof(T) % 4 == 0);
+    Header header {op, static_cast<uint32_t>((sizeof(T) + trailing_size + 7) & ~size_t(7))};
+
+    size_t offset = arena.size();
+    arena.resize(offset + sizeof(Header) + header.size);
+    std::memcpy(arena.data() + offset, &header, sizeof(Header));
+    std::memcpy(arena.data() + offset + sizeof(Header), &command, sizeof(T));
+    if (trailing_size > 0)
+      std::memcpy(arena.data() + offset + sizeof(Header) + sizeof(T), trailing, trailing_size);
+  }
+
+  std::vector<std::byte> arena;
+};
+
+}
+
+#endif // ETNA_RENDER_COMMAND_STREAM_HPP_INCLUDED
@@ -14,7 +14,6 @@ namespace etna
 class RenderTargetState
 {
   SyncCommandBuffer &cmd;
-  static bool inScope;
 public:  
   RenderTargetState(
     SyncCommandBuffer &cmd_,
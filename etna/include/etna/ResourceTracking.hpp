@@ -5,9 +5,255 @@
 #include <etna/Image.hpp>
 #include <etna/Buffer.hpp>
 
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <optional>
+#include <type_traits>
+#include <vector>
+
 namespace etna::tracking
 {
 
+// Vector that keeps up to N elements inline and spills to the heap only when it grows.
+// Only for trivially copyable types: elements are moved around with plain copies.
+template <typename T, uint32_t N>
+struct SmallVector
+{
+  static_assert(std::is_trivially_copyable_v<T>);
+
+  uint32_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  T *data() { return heap.empty()? inlineData.data() : heap.data(); }
+  const T *data() const { return heap.empty()? inlineData.data() : heap.data(); }
+
+  T *begin() { return data(); }
+  T *end() { return data() + count; }
+  const T *begin() const { return data(); }
+  const T *end() const { return data() + count; }
+
+  T &operator[](uint32_t i) { return data()[i]; }
+  const T &operator[](uint32_t i) const { return data()[i]; }
+
+  void clear()
+  {
+    heap.clear();
+    count = 0;
+  }
+
+  void resize(uint32_t n, const T &value = T{})
+  {
+    if (heap.empty() && n <= N)
+    {
+      for (uint32_t i = count; i < n; i++)
+        inlineData[i] = value;
+      count = n;
+      return;
+    }
+    spill();
+    heap.resize(n, value);
+    count = n;
+  }
+
+  T *insert(uint32_t pos, const T &value)
+  {
+    ETNA_ASSERT(pos <= count);
+    if (heap.empty() && count < N)
+    {
+      std::copy_backward(inlineData.begin() + pos, inlineData.begin() + count, inlineData.begin() + count + 1);
+      inlineData[pos] = value;
+      count++;
+      return &inlineData[pos];
+    }
+    spill();
+    heap.insert(heap.begin() + pos, value);
+    count++;
+    return &heap[pos];
+  }
+
+  void push_back(const T &value)
+  {
+    insert(count, value);
+  }
+
+  void erase(uint32_t first, uint32_t last)
+  {
+    ETNA_ASSERT(first <= last && last <= count);
+    if (heap.empty())
+      std::copy(inlineData.begin() + last, inlineData.begin() + count, inlineData.begin() + first);
+    else
+      heap.erase(heap.begin() + first, heap.begin() + last);
+    count -= last - first;
+  }
+
+private:
+  void spill()
+  {
+    if (heap.empty() && count > 0)
+      heap.assign(inlineData.begin(), inlineData.begin() + count);
+  }
+
+  std::array<T, N> inlineData {};
+  std::vector<T> heap;
+  uint32_t count = 0;
+};
+
+// Piecewise constant map over [0, size). Neighbouring elements with equal values are
+// stored as one run, so a uniform range costs a single entry regardless of its length.
+// Index is uint32_t for image subresources and vk::DeviceSize for buffer bytes
+template <typename T, typename Index = uint32_t>
+struct RangeMap
+{
+  struct Run
+  {
+    Index begin;
+    T value;
+  };
+
+  RangeMap() {}
+  explicit RangeMap(Index size, const T &value = T{})
+    : count {size}
+  {
+    runs.push_back(Run{0, value});
+  }
+
+  Index size() const { return count; }
+  uint32_t runsCount() const { return runs.size(); }
+
+  const T &operator[](Index pos) const { return runs[findRun(pos)].value; }
+
+  // end of the run which contains pos
+  Index runEnd(Index pos) const { return endOf(findRun(pos)); }
+
+  // calls f(begin, end, value) for every run clipped to [begin, end)
+  template <typename F>
+  void forEach(Index begin, Index end, F &&f) const
+  {
+    if (begin >= end)
+      return;
+    for (uint32_t i = findRun(begin); i < runs.size() && runs[i].begin < end; i++)
+      f(std::max(begin, runs[i].begin), std::min(end, endOf(i)), runs[i].value);
+  }
+
+  template <typename F>
+  void forEach(F &&f) const
+  {
+    forEach(0, count, f);
+  }
+
+  // calls f(begin, end, value&) for every run in [begin, end). Runs are split at the range
+  // borders before the call and equal neighbours are merged back after it.
+  template <typename F>
+  void update(Index begin, Index end, F &&f)
+  {
+    ETNA_ASSERT(end <= count);
+    if (begin >= end)
+      return;
+    uint32_t first = split(begin);
+    uint32_t last = split(end);
+    for (uint32_t i = first; i < last; i++)
+      f(runs[i].begin, endOf(i), runs[i].value);
+    coalesce(first > 0? first - 1 : 0, std::min(last + 1, runs.size()));
+  }
+
+  template <typename F>
+  void update(F &&f)
+  {
+    update(0, count, f);
+  }
+
+  void assign(Index begin, Index end, const T &value)
+  {
+    update(begin, end, [&](Index, Index, T &dst) { dst = value; });
+  }
+
+private:
+  Index endOf(uint32_t i) const
+  {
+    return i + 1 < runs.size()? runs[i + 1].begin : count;
+  }
+
+  uint32_t findRun(Index pos) const
+  {
+    ETNA_ASSERT(pos < count);
+    auto it = std::upper_bound(runs.begin(), runs.end(), pos, 
+      [](Index p, const Run &run) { return p < run.begin; });
+    return static_cast<uint32_t>(it - runs.begin()) - 1;
+  }
+
+  // returns index of the run which starts at pos
+  uint32_t split(Index pos)
+  {
+    if (pos == count)
+      return runs.size();
+    uint32_t i = findRun(pos);
+    if (runs[i].begin == pos)
+      return i;
+    runs.insert(i + 1, Run{pos, runs[i].value});
+    return i + 1;
+  }
+
+  void coalesce(uint32_t first, uint32_t last)
+  {
+    if (last - first < 2)
+      return;
+    uint32_t out = first;
+    for (uint32_t i = first + 1; i < last; i++)
+    {
+      if (runs[i].value == runs[out].value)
+        continue;
+      runs[++out] = runs[i];
+    }
+    runs.erase(out + 1, last);
+  }
+
+  SmallVector<Run, 1> runs;
+  Index count = 0;
+};
+
+// Stages and accesses for which all previous writes are visible
+inline constexpr vk::PipelineStageFlags2 ALL_STAGES = vk::PipelineStageFlagBits2::eAllCommands;
+inline constexpr vk::AccessFlags2 ALL_ACCESSES = 
+  vk::AccessFlagBits2::eMemoryRead | vk::AccessFlagBits2::eMemoryWrite;
+
+inline constexpr uint32_t NO_EVENT = ~0u;
+
+// What tracking needs to know about an image. Made implicitly from Image, or directly
+// by code that replays request streams without a device
+struct ImageResource
+{
+  ImageResource(const Image &image)
+    : ImageResource {image.getId(), image.get(), image.getAspectMaskByFormat(),
+        image.getInfo().mipLevels, image.getInfo().arrayLayers}
+  {}
+
+  ImageResource(ResourceId id_, vk::Image image_, vk::ImageAspectFlags aspect_, uint32_t mips_, uint32_t layers_)
+    : id {id_}, image {image_}, aspect {aspect_}, mipLevels {mips_}, arrayLayers {layers_}
+  {}
+
+  ResourceId id;
+  vk::Image image;
+  vk::ImageAspectFlags aspect;
+  uint32_t mipLevels;
+  uint32_t arrayLayers;
+};
+
+struct BufferResource
+{
+  BufferResource(const Buffer &buffer)
+    : BufferResource {buffer.getId(), buffer.get(), buffer.getSize()}
+  {}
+
+  BufferResource(ResourceId id_, vk::Buffer buffer_, vk::DeviceSize size_)
+    : id {id_}, buffer {buffer_}, size {size_}
+  {}
+
+  ResourceId id;
+  vk::Buffer buffer;
+  vk::DeviceSize size;
+};
+
 struct ImageState
 {
   struct SubresourceState
@@ -15,102 +261,436 @@ struct ImageState
     vk::PipelineStageFlags2 activeStages {};
     vk::AccessFlags2 activeAccesses {};
     vk::ImageLayout layout {vk::ImageLayout::eUndefined};
+    // stages/accesses that have seen the last write, ignored in requests
+    vk::PipelineStageFlags2 visibleStages {ALL_STAGES};
+    vk::AccessFlags2 visibleAccesses {ALL_ACCESSES};
+    uint32_t event {NO_EVENT}; // split barrier set after the last write
 
     bool operator==(const SubresourceState &) const = default;
   };
 
-  ImageState(const Image &image)
-    : resource {image.get()}, aspect {image.getAspectMaskByFormat()}, 
-      mipLevels {image.getInfo().mipLevels},
-      arrayLayers{image.getInfo().arrayLayers}
+  ImageState(const ImageResource &image)
+    : ImageState {image.image, image.aspect, image.mipLevels, image.arrayLayers}
+  {}
+
+  ImageState(vk::Image img_, vk::ImageAspectFlags aspect_, uint32_t mips_, uint32_t layers_)
+    : resource {img_}, aspect{aspect_}, mipLevels{mips_}, arrayLayers{layers_},
+      aspectPlanes {is_depth_stencil(aspect_)? 2u : 1u},
+      states {aspectPlanes * mips_ * layers_}
+  {}
+
+  static bool is_depth_stencil(vk::ImageAspectFlags aspect)
   {
-    states.resize(mipLevels * arrayLayers, {});
+    auto depthStencil = vk::ImageAspectFlagBits::eDepth | vk::ImageAspectFlagBits::eStencil;
+    return (aspect & depthStencil) == depthStencil;
   }
 
-  ImageState(vk::Image img_, vk::ImageAspectFlags aspect_, uint32_t mips_, uint32_t layers_)
-    : resource {img_}, aspect{aspect_}, mipLevels{mips_}, arrayLayers{layers_}
+  uint32_t planeSize() const { return mipLevels * arrayLayers; }
+
+  // depth and stencil of depth-stencil images are tracked as separate planes
+  vk::ImageAspectFlags planeAspect(uint32_t plane) const
   {
-    states.resize(mipLevels * arrayLayers, {});
+    if (aspectPlanes == 1)
+      return aspect;
+    return plane == 0? vk::ImageAspectFlagBits::eDepth : vk::ImageAspectFlagBits::eStencil;
   }
 
-  std::optional<SubresourceState> &getSubresource(uint32_t mip, uint32_t layer)
+  // calls f(begin, end, aspect) for every contiguous interval of subresource indices covered by range.
+  // Empty range.aspectMask selects all aspects of the image
+  template <typename F>
+  void forEachInterval(const vk::ImageSubresourceRange &range, F &&f) const
   {
-    uint32_t index = layer * mipLevels + mip; 
-    ETNA_ASSERT(index < mipLevels * arrayLayers);
-    return states.at(index);
+    uint32_t levelCount = range.levelCount == VK_REMAINING_MIP_LEVELS? 
+      mipLevels - range.baseMipLevel : range.levelCount;
+    uint32_t layerCount = range.layerCount == VK_REMAINING_ARRAY_LAYERS? 
+      arrayLayers - range.baseArrayLayer : range.layerCount;
+    if (!levelCount || !layerCount)
+      return;
+    ETNA_ASSERT(range.baseMipLevel + levelCount <= mipLevels);
+    ETNA_ASSERT(range.baseArrayLayer + layerCount <= arrayLayers);
+
+    for (uint32_t plane = 0; plane < aspectPlanes; plane++)
+    {
+      auto planeMask = planeAspect(plane);
+      if (range.aspectMask && !(range.aspectMask & planeMask))
+        continue;
+
+      uint32_t offset = plane * planeSize();
+      if (layerCount == arrayLayers) // all layers of consecutive mips are contiguous
+      {
+        f(offset + range.baseMipLevel * arrayLayers, 
+          offset + (range.baseMipLevel + levelCount) * arrayLayers, planeMask);
+        continue;
+      }
+
+      for (uint32_t mip = range.baseMipLevel; mip < range.baseMipLevel + levelCount; mip++)
+      {
+        uint32_t begin = offset + mip * arrayLayers + range.baseArrayLayer;
+        f(begin, begin + layerCount, planeMask);
+      }
+    }
+  }
+
+  // calls f(range) for the minimal set of subresource ranges covering [begin, end)
+  template <typename F>
+  void forEachRange(uint32_t begin, uint32_t end, F &&f) const
+  {
+    while (begin < end)
+    {
+      uint32_t plane = begin / planeSize();
+      uint32_t offset = plane * planeSize();
+      uint32_t planeEnd = std::min(end, offset + planeSize());
+      forEachPlaneRange(planeAspect(plane), begin - offset, planeEnd - offset, f);
+      begin = planeEnd;
+    }
   }
 
   vk::Image resource {};
   vk::ImageAspectFlags aspect{};
   uint32_t mipLevels = 1;
   uint32_t arrayLayers = 1;
-  std::vector<std::optional<SubresourceState>> states; //mips x layers
+  uint32_t aspectPlanes = 1;
+  // index = plane * mipLevels * arrayLayers + mip * arrayLayers + layer,
+  // so whole images and whole mip ranges of one aspect are single runs
+  RangeMap<std::optional<SubresourceState>> states;
+
+private:
+  template <typename F>
+  void forEachPlaneRange(vk::ImageAspectFlags planeMask, uint32_t begin, uint32_t end, F &&f) const
+  {
+    auto emit = [&](uint32_t mip, uint32_t mipCount, uint32_t layer, uint32_t layerCount) {
+      f(vk::ImageSubresourceRange {
+        .aspectMask = planeMask,
+        .baseMipLevel = mip,
+        .levelCount = mipCount,
+        .baseArrayLayer = layer,
+        .layerCount = layerCount
+      });
+    };
+
+    if (begin % arrayLayers != 0) // head, part of one mip
+    {
+      uint32_t headEnd = std::min(end, (begin / arrayLayers + 1) * arrayLayers);
+      emit(begin / arrayLayers, 1, begin % arrayLayers, headEnd - begin);
+      begin = headEnd;
+    }
+    
+    uint32_t fullMips = (end - begin) / arrayLayers;
+    if (fullMips)
+    {
+      emit(begin / arrayLayers, fullMips, 0, arrayLayers);
+      begin += fullMips * arrayLayers;
+    }
+
+    if (begin < end) // tail, starts from layer 0
+      emit(begin / arrayLayers, 1, 0, end - begin);
+  }
 };
 
+// Layout of one aspect of depth-stencil image: combined layouts are replaced by
+// depth-only or stencil-only ones. Other layouts are returned as is.
+vk::ImageLayout aspect_layout(vk::ImageAspectFlags aspect, vk::ImageLayout layout);
+
+vk::ImageLayout apply_layout_policy(LayoutPolicy policy, vk::ImageLayout layout);
+
 using ImageSubresState = ImageState::SubresourceState;
 
 struct BufferState // generates only memory barriers
 {
   vk::PipelineStageFlags2 activeStages {};
   vk::AccessFlags2 activeAccesses {};
+  // stages/accesses that have seen the last write, ignored in requests
+  vk::PipelineStageFlags2 visibleStages {ALL_STAGES};
+  vk::AccessFlags2 visibleAccesses {ALL_ACCESSES};
+  uint32_t event {NO_EVENT}; // split barrier set after the last write
 
   bool operator==(const BufferState &) const = default;
 };
 
+// States of byte ranges of a buffer. Disjoint ranges of a suballocated buffer
+// are tracked separately and don't wait for each other
+struct BufferRanges
+{
+  BufferRanges(const BufferResource &buffer)
+    : BufferRanges {buffer.buffer, buffer.size}
+  {}
+
+  BufferRanges(vk::Buffer buffer_, vk::DeviceSize size_)
+    : resource {buffer_}, states {size_}
+  {}
+
+  // end of [offset, offset + size), VK_WHOLE_SIZE means up to the end of the buffer
+  vk::DeviceSize rangeEnd(vk::DeviceSize offset, vk::DeviceSize size) const
+  {
+    ETNA_ASSERT(offset <= states.size());
+    return size == VK_WHOLE_SIZE? states.size() : std::min(offset + size, states.size());
+  }
+
+  vk::Buffer resource {};
+  RangeMap<std::optional<BufferState>, vk::DeviceSize> states;
+};
+
+struct BarrierStats
+{
+  uint64_t pipelineBarriers = 0; // vkCmdPipelineBarrier2 calls
+  uint64_t imageBarriersBeforeMerge = 0;
+  uint64_t imageBarriersAfterMerge = 0;
+  uint64_t eventWaits = 0;
+};
+
+struct BarrierCacheStats
+{
+  uint64_t hits = 0; // flush points replayed from the cache
+  uint64_t misses = 0; // flush points generated and stored
+};
+
+// Event set right after a producing command. Dependency is made for all later commands,
+// because consumers are not known when the event is set
+struct SplitBarrier
+{
+  vk::Event event {};
+  vk::MemoryBarrier2 dependency {};
+};
+
 struct CmdBarrier
 {
   std::optional<vk::MemoryBarrier2> memoryBarrier;
   std::vector<vk::ImageMemoryBarrier2> imageBarriers;
+  std::vector<vk::BufferMemoryBarrier2> bufferBarriers; // only for queue family ownership transfers
+  std::vector<SplitBarrier> waitEvents;
 
+  // waits for events, merges image barriers of adjacent subresources, then records them
   void flush(vk::CommandBuffer cmd);
   void clear()
   {
     memoryBarrier = std::nullopt;
     imageBarriers.clear();
+    bufferBarriers.clear();
+    waitEvents.clear();
+  }
+  bool empty() const
+  {
+    return !memoryBarrier.has_value() && imageBarriers.empty() && bufferBarriers.empty() && waitEvents.empty();
   }
+
+  const BarrierStats &getStats() const { return stats; }
+  void resetStats() { stats = BarrierStats{}; }
+
+private:
+  BarrierStats stats;
 };
 
-using HandleT = uint64_t; 
+// Ids are handed out by Image/Buffer constructors and returned on destruction.
+// A recycled slot index always comes with a new generation, so a new resource
+// can never pick up the state of a destroyed one.
+ResourceId allocate_resource_id();
+void free_resource_id(ResourceId id);
+
+// Called by free_resource_id, so states of destroyed resources are dropped by whoever keeps them.
+// GlobalContext installs one for its queues, without a handler resources are destroyed without a device
+void set_resource_deletion_handler(std::function<void(ResourceId)> handler);
 
-inline HandleT to_handle(const Image &image)
+inline constexpr uint32_t resource_index(ResourceId id)
 {
-  return reinterpret_cast<HandleT>(VkImage(image.get()));
+  return static_cast<uint32_t>(id & 0xffffffffull);
 }
 
-inline HandleT to_handle(const Buffer &buffer)
+inline constexpr uint32_t resource_generation(ResourceId id)
 {
-  return reinterpret_cast<HandleT>(VkBuffer(buffer.get()));
+  return static_cast<uint32_t>(id >> 32);
 }
 
+// Slot map of resource states. Image and buffer states live in two dense arrays,
+// a sparse table indexed by the slot part of ResourceId points into them.
+// Lookups don't hash, and walks over all states touch only contiguous memory.
+// Removal swaps the last element into the hole, so pointers to states are
+// invalidated by any insertion or removal.
+struct ResContainer
+{
+  ImageState *findImage(ResourceId id)
+  {
+    uint32_t pos = findPos(id, imageIds, 0);
+    return pos != INVALID_POS? &imageStates[pos] : nullptr;
+  }
+
+  const ImageState *findImage(ResourceId id) const
+  {
+    uint32_t pos = findPos(id, imageIds, 0);
+    return pos != INVALID_POS? &imageStates[pos] : nullptr;
+  }
+
+  BufferRanges *findBuffer(ResourceId id)
+  {
+    uint32_t pos = findPos(id, bufferIds, BUFFER_BIT);
+    return pos != INVALID_POS? &bufferStates[pos] : nullptr;
+  }
+
+  const BufferRanges *findBuffer(ResourceId id) const
+  {
+    uint32_t pos = findPos(id, bufferIds, BUFFER_BIT);
+    return pos != INVALID_POS? &bufferStates[pos] : nullptr;
+  }
+
+  ImageState &addImage(ResourceId id, const ImageState &state);
+  BufferRanges &addBuffer(ResourceId id, const BufferRanges &state);
+  void erase(ResourceId id);
+
+  template <typename F>
+  void forEachImage(F &&f)
+  {
+    for (uint32_t i = 0; i < imageStates.size(); i++)
+      f(imageIds[i], imageStates[i]);
+  }
+
+  template <typename F>
+  void forEachImage(F &&f) const
+  {
+    for (uint32_t i = 0; i < imageStates.size(); i++)
+      f(imageIds[i], imageStates[i]);
+  }
+
+  template <typename F>
+  void forEachBuffer(F &&f)
+  {
+    for (uint32_t i = 0; i < bufferStates.size(); i++)
+      f(bufferIds[i], bufferStates[i]);
+  }
+
+  template <typename F>
+  void forEachBuffer(F &&f) const
+  {
+    for (uint32_t i = 0; i < bufferStates.size(); i++)
+      f(bufferIds[i], bufferStates[i]);
+  }
+
+  std::size_t size() const { return imageStates.size() + bufferStates.size(); }
+  bool empty() const { return size() == 0; }
 
-// TODO: we definetly get a situation, when resource is deleted
-// but it's Handle is still in TrackingState. Any new resource can get the same handle.
-// The best way is to add 64-bit  id to each resource that are always increasing 
+  void clear()
+  {
+    // sparse table keeps its size, so it is not reallocated every frame
+    std::fill(sparse.begin(), sparse.end(), INVALID_POS);
+    imageIds.clear();
+    imageStates.clear();
+    bufferIds.clear();
+    bufferStates.clear();
+  }
 
-using ResContainer = std::unordered_map<HandleT, std::variant<ImageState, BufferState>>;
+private:
+  static constexpr uint32_t INVALID_POS = ~0u;
+  static constexpr uint32_t BUFFER_BIT = 1u << 31u;
+
+  uint32_t findPos(ResourceId id, const std::vector<ResourceId> &ids, uint32_t kind) const
+  {
+    uint32_t slot = resource_index(id);
+    if (slot >= sparse.size() || sparse[slot] == INVALID_POS || (sparse[slot] & BUFFER_BIT) != kind)
+      return INVALID_POS;
+    uint32_t pos = sparse[slot] & ~BUFFER_BIT;
+    return ids[pos] == id? pos : INVALID_POS;
+  }
+
+  uint32_t &slotFor(ResourceId id); // grows sparse table and drops a stale entry in the slot
+  void eraseSlot(uint32_t slot);
+
+  std::vector<uint32_t> sparse; // resource slot -> position in images/buffers | BUFFER_BIT
+  std::vector<ResourceId> imageIds;
+  std::vector<ImageState> imageStates;
+  std::vector<ResourceId> bufferIds;
+  std::vector<BufferRanges> bufferStates;
+};
+
+struct QueueTrackingState;
+
+// Release half of queue family ownership transfers. It is recorded on the queue which
+// owned the resources, and the command buffer that acquires them waits for it with a semaphore.
+struct OwnershipRelease
+{
+  QueueTrackingState *queue = nullptr; // previous owner
+  std::vector<ResourceId> resources {};
+  std::vector<vk::ImageMemoryBarrier2> imageBarriers {};
+  std::vector<vk::BufferMemoryBarrier2> bufferBarriers {};
+};
 
 struct CmdBufferTrackingState
 {
   CmdBufferTrackingState() {}
 
   //Sets resource state. 
-  void expectState(const Image &image, uint32_t mip, uint32_t layer, ImageState::SubresourceState state);
-  void expectState(const Buffer &buffer, BufferState state);
+  void expectState(const ImageResource &image, uint32_t mip, uint32_t layer, ImageState::SubresourceState state);
+  void expectState(const ImageResource &image, vk::ImageSubresourceRange range, ImageState::SubresourceState state);
+  void expectState(const BufferResource &buffer, BufferState state);
+  // size can be VK_WHOLE_SIZE
+  void expectState(const BufferResource &buffer, vk::DeviceSize offset, vk::DeviceSize size, BufferState state);
   
-  void initResourceStates(const ResContainer &states);
-  void initResourceStates(ResContainer &&states);
+  // resource states are read from the queue lazily, when resource is used first time.
+  // Resources owned by another queue family are transferred to this queue as a whole
+  void setQueueState(const QueueTrackingState *queue) { queueState = queue; }
+
+  // Requested and expected image layouts are mapped by the policy. Commands that use
+  // the layouts should be recorded with mapLayout results
+  void setLayoutPolicy(LayoutPolicy policy) { layoutPolicy = policy; }
+  LayoutPolicy getLayoutPolicy() const { return layoutPolicy; }
+  vk::ImageLayout mapLayout(vk::ImageLayout layout) const { return apply_layout_policy(layoutPolicy, layout); }
 
   //requests transition to new state
-  void requestState(const Image &image, uint32_t mip, uint32_t layer, ImageState::SubresourceState state);
-  void requestState(const Image &image, uint32_t firstMip, uint32_t mipCount, 
+  void requestState(const ImageResource &image, uint32_t mip, uint32_t layer, ImageState::SubresourceState state);
+  void requestState(const ImageResource &image, uint32_t firstMip, uint32_t mipCount, 
     uint32_t firstLayer, uint32_t layerCount, ImageState::SubresourceState state);
-  // for now range.aspectMask is ignored
-  void requestState(const Image &image, vk::ImageSubresourceRange range, ImageState::SubresourceState state);
-
-  void requestState(const Buffer &buffer, BufferState state);
+  // empty range.aspectMask means all aspects of the image
+  void requestState(const ImageResource &image, vk::ImageSubresourceRange range, ImageState::SubresourceState state);
+
+  void requestState(const BufferResource &buffer, BufferState state);
+  // only overlapping byte ranges are synchronized, size can be VK_WHOLE_SIZE
+  void requestState(const BufferResource &buffer, vk::DeviceSize offset, vk::DeviceSize size, BufferState state);
+
+  // Contents of the range are not needed, the next transition goes from eUndefined layout.
+  // Pending writes are still synchronized. Images owned by another queue family are not discarded,
+  // their contents come with the ownership transfer
+  void discard(const ImageResource &image, vk::ImageSubresourceRange range);
+
+  // true if state can't be merged into already requested states without a barrier between them:
+  // layouts differ or one of the accesses is a write
+  bool conflictsWithRequests(const ImageResource &image, vk::ImageSubresourceRange range, 
+    const ImageState::SubresourceState &state) const;
+  bool conflictsWithRequests(const BufferResource &buffer, const BufferState &state) const;
+  bool conflictsWithRequests(const BufferResource &buffer, vk::DeviceSize offset, vk::DeviceSize size,
+    const BufferState &state) const;
+
+  // Moves requests of other into this state as if they were requested here.
+  // For requests collected by separate states on other threads
+  void takeRequests(CmdBufferTrackingState &other);
 
   void flushBarrier(CmdBarrier &barrier);
 
+  // Split barriers. When enabled, flushBarrier remembers resources written by the next command.
+  // signalWrites tags them with an event which is set right after that command and
+  // returns the dependency for vkCmdSetEvent2. The first access that conflicts with a tagged
+  // write waits on the event instead of getting a pipeline barrier.
+  // Layout transitions still use pipeline barriers.
+  void setSplitBarriers(bool enable) { splitBarriers = enable; }
+  bool splitBarriersEnabled() const { return splitBarriers; }
+  bool hasSignalableWrites() const { return !lastImageWrites.empty() || !lastBufferWrites.empty(); }
+  std::optional<vk::MemoryBarrier2> signalWrites(vk::Event event);
+  void dropEvents(); // events are valid only inside one command buffer
+
+  // When enabled, image hazards without a layout change are merged into the global memory barrier,
+  // like buffer hazards. Image barriers are generated only for layout transitions and ownership transfers
+  void setGlobalImageBarriers(bool enable)
+  {
+    if (enable != globalImageBarriers)
+      barrierPlans.clear(); // cached plans were generated with the other policy
+    globalImageBarriers = enable;
+  }
+  bool globalImageBarriersEnabled() const { return globalImageBarriers; }
+
+  // Barrier plan caching. Flush points are numbered from the start of the command buffer.
+  // If requests and incoming states at a flush point are the same as in the previous recording,
+  // stored barriers and resulting states are replayed instead of generated.
+  // Not used with split barriers and for flushes with ownership transfers
+  void setBarrierCaching(bool enable) { barrierCaching = enable; }
+  bool barrierCachingEnabled() const { return barrierCaching; }
+  const BarrierCacheStats &getBarrierCacheStats() const { return cacheStats; }
+
   void onSync(); //sets all activeStages and accesses to zero, saves image layouts
   void removeUnusedResources(); // removes expectedResources that were not used
 
@@ -126,6 +706,11 @@ struct CmdBufferTrackingState
     return resources;
   }
 
+  const std::vector<OwnershipRelease> &getOwnershipReleases() const
+  {
+    return ownershipReleases;
+  }
+
   const ResContainer &getExpectedStates() const
   {
     return expectedResources;
@@ -138,52 +723,146 @@ struct CmdBufferTrackingState
 
   void clearAll()
   {
+    flushIndex = 0;
     expectedResources.clear();
     resources.clear();
     requests.clear();
+    events.clear();
+    lastImageWrites.clear();
+    lastBufferWrites.clear();
+    ownershipReleases.clear();
   }
 
 private:
-  BufferState &acquireResource(HandleT handle);
-  ImageSubresState &acquireResource(HandleT handle, 
-    const ImageState &request_state, uint32_t mip, uint32_t layer);
-
+  ImageState &findOrImportExpected(ResourceId id, const ImageState &proto);
+  BufferRanges &findOrImportExpected(ResourceId id, const BufferRanges &proto);
+  // makes sure resources contain states for [begin, end) subresources or bytes
+  ImageState &acquireResource(ResourceId id, const ImageState &request_state, uint32_t begin, uint32_t end);
+  BufferRanges &acquireResource(ResourceId id, const BufferRanges &request_state, 
+    vk::DeviceSize begin, vk::DeviceSize end);
+
+  // returns barrier without subresourceRange
   static std::optional<vk::ImageMemoryBarrier2> genBarrier(vk::Image img,
-    vk::ImageAspectFlags aspect,
-    uint32_t mip,
-    uint32_t layer,
     ImageState::SubresourceState &src,
     const ImageState::SubresourceState &dst);
 
+  // merges dependency into the global memory barrier
+  template <typename State>
   static void genBarrier(std::optional<vk::MemoryBarrier2> &barrier,
-    BufferState &src,
-    const BufferState &dst);
+    State &src,
+    const State &dst);
+
+  template <typename State>
+  void waitEvent(CmdBarrier &barrier, State &src) const;
+
+  // queue of another family which owns the resource not used by this command buffer yet
+  QueueTrackingState *foreignOwner(ResourceId id) const;
+  OwnershipRelease &releaseFor(QueueTrackingState *owner, ResourceId id);
+  // generates acquire barrier for [begin, end) subresources or bytes, dst is nullptr if they are not requested
+  void acquireOwnership(CmdBarrier &barrier, QueueTrackingState *owner, ResourceId id, const ImageState &image,
+    uint32_t begin, uint32_t end, ImageState::SubresourceState &src, const ImageState::SubresourceState *dst);
+  void acquireOwnership(CmdBarrier &barrier, QueueTrackingState *owner, ResourceId id, const BufferRanges &buffer,
+    vk::DeviceSize begin, vk::DeviceSize end, BufferState &src, const BufferState *dst);
+
+  template <typename Index>
+  struct WrittenRange
+  {
+    ResourceId id;
+    Index begin;
+    Index end;
+  };
+
+  // requested range with its incoming state
+  template <typename State, typename Index>
+  struct PlanEntry
+  {
+    ResourceId id;
+    Index begin;
+    Index end;
+    State src;
+    State dst;
 
+    bool operator==(const PlanEntry &) const = default;
+  };
+
+  struct BarrierPlan
+  {
+    std::size_t hash = 0;
+    std::vector<PlanEntry<ImageSubresState, uint32_t>> images;
+    std::vector<PlanEntry<BufferState, vk::DeviceSize>> buffers;
+    // states of entries after the flush
+    std::vector<ImageSubresState> imageResults;
+    std::vector<BufferState> bufferResults;
+
+    std::optional<vk::MemoryBarrier2> memoryBarrier;
+    std::vector<vk::ImageMemoryBarrier2> imageBarriers;
+    std::vector<vk::BufferMemoryBarrier2> bufferBarriers;
+
+    bool sameRequests(const BarrierPlan &plan) const
+    {
+      return hash == plan.hash && images == plan.images && buffers == plan.buffers;
+    }
+  };
+
+  void generateBarrier(CmdBarrier &barrier);
+  // fills requests with incoming states, false if the flush transfers ownership
+  bool collectPlan(BarrierPlan &plan);
+
+  const QueueTrackingState *queueState = nullptr;
   ResContainer expectedResources; //for validation on submit
   ResContainer resources;
   ResContainer requests;
+
+  LayoutPolicy layoutPolicy = LayoutPolicy::Exact;
+  bool splitBarriers = false;
+  bool globalImageBarriers = false;
+
+  bool barrierCaching = false;
+  uint32_t flushIndex = 0;
+  std::vector<BarrierPlan> barrierPlans; // indexed by flush point, kept between recordings
+  BarrierPlan currentPlan;
+  BarrierCacheStats cacheStats;
+  std::vector<SplitBarrier> events; // indexed by state.event
+  std::vector<WrittenRange<uint32_t>> lastImageWrites;
+  std::vector<WrittenRange<vk::DeviceSize>> lastBufferWrites;
+  std::vector<OwnershipRelease> ownershipReleases;
 };
 
+// One per queue. A resource is owned by a single queue, its state is kept only there
 struct QueueTrackingState
 {
+  explicit QueueTrackingState(uint32_t family_index = 0) : familyIndex {family_index} {}
+
   void onWait(); //clears all activeStages/activeAccesses
-  void onSubmit(CmdBufferTrackingState &state); //validates expected resources, updates currentState
+  //validates expected resources, updates currentState
+  // With prologue, mismatching states of resources owned by this queue are not an error.
+  // Barriers from actual to expected states are added to prologue, it must be executed right before 
+  // the command buffer. So command buffers can be recorded in any order
+  void onSubmit(CmdBufferTrackingState &state, CmdBarrier *prologue = nullptr);
   
   //TODO: 
-  bool isResourceUsed(const Buffer &buffer) const;
-  bool isResourceUsed(const Image &image, uint32_t mip, uint32_t layer) const;
+  bool isResourceUsed(const BufferResource &buffer) const;
+  bool isResourceUsed(const ImageResource &image, uint32_t mip, uint32_t layer) const;
   
-  void setExpectedStates(CmdBufferTrackingState &state) const //reads current states from queue
+  const ResContainer &getStates() const
   {
-    state.initResourceStates(currentStates);
+    return currentStates;
   }
 
-  void onResourceDeletion(HandleT handle)
+  void onResourceDeletion(ResourceId id)
   {
-    currentStates.erase(handle);
+    currentStates.erase(id);
   }
 
+  uint32_t getFamilyIndex() const { return familyIndex; }
+
+  // queues of other families which may own resources used by this queue
+  void addPeer(QueueTrackingState *queue) { peers.push_back(queue); }
+  QueueTrackingState *findOwner(ResourceId id) const;
+
 private:
+  uint32_t familyIndex;
+  std::vector<QueueTrackingState *> peers;
   ResContainer currentStates;
 };
 
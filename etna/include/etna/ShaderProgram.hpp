@@ -12,6 +12,7 @@
 #include <unordered_map>
 #include <memory>
 #include <functional>
+#include <span>
 
 namespace etna
 {
@@ -53,6 +54,12 @@ namespace etna
     vk::DescriptorSetLayout getDescriptorSetLayout(uint32_t set) const;
     DescriptorLayoutId getDescriptorLayoutId(uint32_t set) const;
     const DescriptorSetInfo &getDescriptorSetInfo(uint32_t set) const;
+    // stages of this program that reference each binding of the set, empty mask if none does.
+    // Narrower than the layout stage flags only when a patch callback widened the layout
+    std::span<const vk::ShaderStageFlags> getBindingStages(uint32_t set) const;
+    // storage read/write accesses of each binding allowed by NonWritable/NonReadable decorations
+    // in shaders of this program, empty mask if no shader references the binding
+    std::span<const vk::AccessFlags2> getBindingStorageAccess(uint32_t set) const;
 
   private:
     ShaderProgramInfo(const ShaderProgramManager &manager, ShaderProgramId prog_id)
@@ -120,6 +127,10 @@ namespace etna
 
       std::bitset<MAX_PROGRAM_DESCRIPTORS> usedDescriptors;
       std::array<DescriptorLayoutId, MAX_PROGRAM_DESCRIPTORS> descriptorIds;
+      // Usage of every binding by shaders of the program. Reflected layouts already have exactly these
+      // stages, they differ only for layouts widened by patchCB, which several programs may share
+      std::array<std::array<vk::ShaderStageFlags, MAX_DESCRIPTOR_BINDINGS>, MAX_PROGRAM_DESCRIPTORS> bindingStages;
+      std::array<std::array<vk::AccessFlags2, MAX_DESCRIPTOR_BINDINGS>, MAX_PROGRAM_DESCRIPTORS> bindingStorageAccess;
     
       vk::PushConstantRange pushConst {};
       vk::UniquePipelineLayout progLayout;
@@ -5,15 +5,20 @@
 #include <etna/ResourceTracking.hpp>
 #include <etna/GraphicsPipeline.hpp>
 #include <etna/ComputePipeline.hpp>
+#include <etna/RenderCommandStream.hpp>
+#include <etna/DescriptorSet.hpp>
+
+#include <functional>
+#include <memory>
+#include <optional>
 
 namespace etna
 {
-struct DescriptorSet;
 struct SyncCommandBuffer;
 
 struct CommandBufferPool
 {
-  CommandBufferPool();
+  CommandBufferPool(QueueType queue_type = QueueType::Universal);
   CommandBufferPool(CommandBufferPool &&) = default;
   ~CommandBufferPool();
 
@@ -22,11 +27,47 @@ struct CommandBufferPool
   vk::UniqueCommandBuffer allocatePrimary();
   vk::UniqueCommandBuffer allocateSecondary();
 
+  // command buffers are submitted to this queue
+  QueueType getQueueType() const { return queueType; }
+
 private:
+  QueueType queueType;
   vk::UniqueCommandPool primaryCmd;
   vk::UniqueCommandPool secondaryCmd;
 };
 
+struct SecondaryPoolStats
+{
+  uint32_t allocated = 0; // command buffers owned by the pool
+  uint32_t highWaterMark = 0; // max command buffers used between two resets
+  uint64_t allocations = 0; // vkAllocateCommandBuffers calls
+  uint64_t resets = 0; // vkResetCommandPool calls
+};
+
+// Secondary command buffers of one SyncCommandBuffer. They are allocated once and reused,
+// the whole pool is reset with vkResetCommandPool when the owner is reset after its fence
+struct SecondaryCommandBufferPool
+{
+  SecondaryCommandBufferPool(QueueType queue_type);
+
+  vk::CommandBuffer acquire();
+  // all acquired buffers must be finished by the device
+  void reset();
+
+  const SecondaryPoolStats &getStats() const { return stats; }
+
+private:
+  vk::UniqueCommandPool pool;
+  std::vector<vk::CommandBuffer> buffers; // freed with the pool
+  uint32_t used = 0;
+  SecondaryPoolStats stats;
+};
+
+struct StateFilterStats
+{
+  uint64_t filteredCalls = 0; // binds and dynamic state identical to what is already bound
+  uint64_t skippedRequests = 0; // bindings whose states are already requested for the next barrier
+};
 
 struct SubmitInfo
 {
@@ -47,6 +88,78 @@ struct RenderingAttachment
   vk::ClearValue clearValue {vk::ClearColorValue{0.f, 0.f, 0.f, 0.f}}; 
 };
 
+// Resources and states used by a group of commands
+struct StateRequests
+{
+  std::vector<std::tuple<const Buffer *, vk::DeviceSize, vk::DeviceSize, BufferState>> buffers; // offset, size
+  std::vector<std::tuple<const Image *, vk::ImageSubresourceRange, ImageSubresState>> images;
+
+  void add(const Buffer &buffer, BufferState state, 
+    vk::DeviceSize offset = 0, vk::DeviceSize size = VK_WHOLE_SIZE)
+  {
+    buffers.emplace_back(&buffer, offset, size, state);
+  }
+
+  void add(const Image &image, vk::ImageSubresourceRange range, ImageSubresState state)
+  {
+    images.emplace_back(&image, range, state);
+  }
+
+  void clear()
+  {
+    buffers.clear();
+    images.clear();
+  }
+};
+
+// Records a part of a render pass on its own thread, see SyncCommandBuffer::beginParallelRecording.
+// Has its own secondary command buffer and command pool, and collects resource states locally,
+// they are merged into the command buffer at endRendering
+struct ParallelRenderContext
+{
+  ParallelRenderContext(QueueType queue_type);
+
+  void bindPipeline(const GraphicsPipeline &pipeline);
+  void bindDescriptorSet(vk::PipelineLayout layout, uint32_t set_index, 
+    const DescriptorSet &set, std::span<const uint32_t> dynamic_offsets = {});
+  void pushConstants(ShaderProgramId program, uint32_t offset, uint32_t size, const void *data);
+
+  template <typename T>
+  void pushConstants(ShaderProgramId program, uint32_t offset, const T &data)
+  {
+    pushConstants(program, offset, sizeof(T), &data);
+  }
+
+  void bindVertexBuffer(uint32_t binding_index, const Buffer &buffer, vk::DeviceSize offset);
+  void bindIndexBuffer(const Buffer &buffer, uint32_t offset, vk::IndexType type);
+  void draw(uint32_t vertex_count, uint32_t instance_count, uint32_t first_vertex, uint32_t first_index);
+  void drawIndexed(uint32_t index_cout, uint32_t instance_count, 
+    uint32_t first_index, uint32_t vertex_offset, uint32_t first_instance);
+
+  void drawIndirect(const Buffer &buffer, vk::DeviceSize offset, uint32_t draw_count,
+    uint32_t stride = sizeof(vk::DrawIndirectCommand));
+  void drawIndexedIndirect(const Buffer &buffer, vk::DeviceSize offset, uint32_t draw_count,
+    uint32_t stride = sizeof(vk::DrawIndexedIndirectCommand));
+  void drawIndirectCount(const Buffer &buffer, vk::DeviceSize offset, const Buffer &count_buffer,
+    vk::DeviceSize count_offset, uint32_t max_draw_count, uint32_t stride = sizeof(vk::DrawIndirectCommand));
+  void drawIndexedIndirectCount(const Buffer &buffer, vk::DeviceSize offset, const Buffer &count_buffer,
+    vk::DeviceSize count_offset, uint32_t max_draw_count, uint32_t stride = sizeof(vk::DrawIndexedIndirectCommand));
+
+  void setViewport(uint32_t first_viewport, vk::ArrayProxy<const vk::Viewport> viewports);
+  void setScissor(uint32_t first_scissor, vk::ArrayProxy<const vk::Rect2D> scissors);
+
+  vk::CommandBuffer get() const { return cmd; }
+
+private:
+  friend struct SyncCommandBuffer;
+
+  SecondaryCommandBufferPool pool;
+  CmdBufferTrackingState trackingState; // only requests, taken by the command buffer at endRendering
+  vk::CommandBuffer cmd {};
+  ShaderProgramId boundProgram = INVALID_SHADER_PROGRAM_ID;
+  std::array<std::optional<DescriptorSet>, MAX_PROGRAM_DESCRIPTORS> boundSets;
+};
+
 struct SyncCommandBuffer
 {
   SyncCommandBuffer(CommandBufferPool &pool_);
@@ -60,10 +173,11 @@ struct SyncCommandBuffer
     return *cmd;
   }
 
+  // only with secondary render passes, otherwise commands of a pass are not recorded until endRendering
   vk::CommandBuffer getRenderCmd() const 
   {
     ETNA_ASSERT(currentState == State::Rendering && renderCmd.has_value());
-    return renderCmd->get();
+    return *renderCmd;
   }
 
   const vk::CommandBuffer &get() const
@@ -81,6 +195,94 @@ struct SyncCommandBuffer
     return trackingState;
   }
 
+  // accumulated over the whole lifetime of the command buffer
+  const tracking::BarrierStats &getBarrierStats() const
+  {
+    return barrier.getStats();
+  }
+
+  // Opt-in. Transfer, dispatch and render pass writes set an event right after the command,
+  // and the first consumer waits on it, so commands between them are not blocked.
+  void setSplitBarriers(bool enable)
+  {
+    trackingState.setSplitBarriers(enable);
+  }
+
+  // Opt-in. For command buffers which record the same commands every frame.
+  // Barriers of a flush point are reused when its requests and incoming states didn't change
+  void setBarrierCaching(bool enable)
+  {
+    trackingState.setBarrierCaching(enable);
+  }
+
+  const tracking::BarrierCacheStats &getBarrierCacheStats() const
+  {
+    return trackingState.getBarrierCacheStats();
+  }
+
+  // Opt-in. Render passes are recorded into secondary command buffers and executed at endRendering.
+  // By default pass commands are kept in a CPU-side stream and replayed into this command buffer
+  void setSecondaryRenderPasses(bool enable)
+  {
+    ETNA_ASSERT(currentState != State::Rendering);
+    secondaryRenderPasses = enable;
+  }
+
+  // Opt-in. Pipeline, descriptor set, vertex and index buffer binds, viewports and scissors identical
+  // to the bound ones are dropped, within a render pass and outside of render passes separately.
+  // States of a rebound set or buffer are not requested again until a barrier consumes them.
+  // Commands recorded directly through get() are not seen, call resetBoundState after them
+  void setStateFiltering(bool enable)
+  {
+    stateFiltering = enable;
+    resetBoundState();
+  }
+
+  void resetBoundState()
+  {
+    renderBound.clear();
+    computeBound.clear();
+  }
+
+  const StateFilterStats &getStateFilterStats() const
+  {
+    return filterStats;
+  }
+
+  // secondary command buffers used for render passes
+  const SecondaryPoolStats &getSecondaryPoolStats() const
+  {
+    return secondaryCmds.getStats();
+  }
+
+  // Opt-in. States expected by the command buffer are not required to match the queue at submit.
+  // Transitions from actual states are recorded into a prologue submitted right before it,
+  // so command buffers can be recorded out of submission order
+  void setFixupOnSubmit(bool enable)
+  {
+    fixupOnSubmit = enable;
+  }
+
+  // Opt-in. Image hazards that don't change layout go to the single global memory barrier
+  // instead of per-subresource image barriers. Works well for long compute chains.
+  void setGlobalImageBarriers(bool enable)
+  {
+    trackingState.setGlobalImageBarriers(enable);
+  }
+
+  // Transfer commands recorded between beginBatch and endBatch share one barrier.
+  // They are deferred and recorded together at endBatch, or earlier when a command 
+  // conflicts with already batched ones. Only transfer commands are allowed inside a batch.
+  void beginBatch();
+  void endBatch();
+
+  // Commands recorded between beginUnsynchronized and endUnsynchronized are not tracked.
+  // The caller declares every resource they use, barriers for declared states are issued once
+  // at scope entry. Inside a render pass they go to the barrier before it.
+  // Descriptor sets, vertex and index buffers bound inside the scope are not synchronized
+  void beginUnsynchronized(const StateRequests &declared);
+  void endUnsynchronized();
+
   void copyBuffer(const Buffer &src, const Buffer &dst,
     const vk::ArrayProxy<vk::BufferCopy> &regions);
 
@@ -100,11 +302,16 @@ struct SyncCommandBuffer
 
   void transformLayout(const Image &image, vk::ImageLayout layout, vk::ImageSubresourceRange range);
 
+  // Contents of the range will be fully overwritten, the next layout transition doesn't preserve them.
+  // beginRendering does it for attachments with eClear/eDontCare loadOp covered by the render area
+  void discard(const Image &image, vk::ImageSubresourceRange range);
+
   void bindDescriptorSet(vk::PipelineBindPoint bind_point, vk::PipelineLayout layout, 
     uint32_t set_index, const DescriptorSet &set, std::span<const uint32_t> dynamic_offsets = {});
 
   void bindPipeline(vk::PipelineBindPoint bind_point, const PipelineBase &pipeline);  
   void dispatch(uint32_t groups_x, uint32_t groups_y, uint32_t groups_z);
+  void dispatchIndirect(const Buffer &buffer, vk::DeviceSize offset);
   void pushConstants(ShaderProgramId program, uint32_t offset, uint32_t size, const void *data);  
 
   template <typename T>
@@ -120,12 +327,36 @@ struct SyncCommandBuffer
   
   void endRendering();
 
+  // Splits recording of the current render pass between count contexts, each can be used 
+  // by its own thread until endRendering. Commands recorded into the pass before this call 
+  // set up state every context starts with, e.g. viewport and scissor of RenderTargetState.
+  // After it, render pass commands go only to contexts. They are executed in index order,
+  // and their resource states are merged in the same order.
+  // Not available with secondary render passes
+  void beginParallelRecording(uint32_t count);
+  ParallelRenderContext &getParallelContext(uint32_t index)
+  {
+    ETNA_ASSERT(currentState == State::Rendering && index < usedParallelContexts);
+    return *parallelContexts[index];
+  }
+
   void bindVertexBuffer(uint32_t binding_index, const Buffer &buffer, vk::DeviceSize offset);
   void bindIndexBuffer(const Buffer &buffer, uint32_t offset, vk::IndexType type);
   void draw(uint32_t vertex_count, uint32_t instance_count, uint32_t first_vertex, uint32_t first_index);
   void drawIndexed(uint32_t index_cout, uint32_t instance_count, 
     uint32_t first_index, uint32_t vertex_offset, uint32_t first_instance);
 
+  // Argument buffers are requested for indirect command reads, so writes made by earlier
+  // passes, e.g. GPU culling, are synchronized. Count variants need supportsDrawIndirectCount
+  void drawIndirect(const Buffer &buffer, vk::DeviceSize offset, uint32_t draw_count,
+    uint32_t stride = sizeof(vk::DrawIndirectCommand));
+  void drawIndexedIndirect(const Buffer &buffer, vk::DeviceSize offset, uint32_t draw_count,
+    uint32_t stride = sizeof(vk::DrawIndexedIndirectCommand));
+  void drawIndirectCount(const Buffer &buffer, vk::DeviceSize offset, const Buffer &count_buffer,
+    vk::DeviceSize count_offset, uint32_t max_draw_count, uint32_t stride = sizeof(vk::DrawIndirectCommand));
+  void drawIndexedIndirectCount(const Buffer &buffer, vk::DeviceSize offset, const Buffer &count_buffer,
+    vk::DeviceSize count_offset, uint32_t max_draw_count, uint32_t stride = sizeof(vk::DrawIndexedIndirectCommand));
+
   void setViewport(uint32_t first_viewport, vk::ArrayProxy<const vk::Viewport> viewports);
   void setScissor(uint32_t first_scissor, vk::ArrayProxy<const vk::Rect2D> scissors);
 
@@ -161,8 +392,18 @@ private:
   {
     trackingState.flushBarrier(barrier);
     barrier.flush(*cmd);
+    flushCount++;
   }
 
+  // sets split barrier event after a command that wrote resources
+  void signalWrites();
+
+  // requests states for a transfer command. In a batch flushes it first if requests conflict
+  void requestTransferStates();
+  // records transfer command now, or defers it until the end of batch
+  void recordTransfer(std::function<void(vk::CommandBuffer)> &&record);
+  void flushBatch();
+
   // TODO - add state validation
   enum class State // https://registry.khronos.org/vulkan/site/spec/latest/chapters/cmdbuffers.html
   {
@@ -170,6 +411,7 @@ private:
     Recording, // -> acquire resources, record commands 
     Executable, // end()
     Rendering, // recording draws
+    Batching, // recording transfer commands with a shared barrier
     Pending // after submit
     // Invalid - TODO
   };
@@ -180,6 +422,10 @@ private:
     std::vector<vk::RenderingAttachmentInfo> colorAttachments;
     std::optional<vk::RenderingAttachmentInfo> depthAttachment;
     std::optional<vk::RenderingAttachmentInfo> stencilAttachment;
+    // for secondary command buffers
+    std::vector<vk::Format> colorFormats;
+    vk::Format depthFormat {vk::Format::eUndefined};
+    vk::Format stencilFormat {vk::Format::eUndefined};
 
     RenderInfo(){}
     RenderInfo(RenderInfo &&) = default;
@@ -193,9 +439,95 @@ private:
   State currentState = State::Initial;
   
   std::optional<RenderInfo> renderState {};
-  std::optional<vk::UniqueCommandBuffer> renderCmd {};
-  
-  std::vector<vk::UniqueCommandBuffer> usedRenderCmd;
+  std::optional<vk::CommandBuffer> renderCmd {}; // only with secondary render passes
+  SecondaryCommandBufferPool secondaryCmds;
+  RenderCommandStream renderCommands; // commands of the current pass, capacity is reused
+
+  // allocated on demand and reused, pointers stay valid while other threads record
+  std::vector<std::unique_ptr<ParallelRenderContext>> parallelContexts;
+  uint32_t usedParallelContexts = 0; // in the current render pass
+  std::vector<vk::CommandBuffer> executedContexts; // reused for vkCmdExecuteCommands
+
+  void beginSecondary(vk::CommandBuffer secondary);
+
+  // programs of bound graphics and compute pipelines, select stages for descriptor set states
+  std::array<ShaderProgramId, 2> boundPrograms {INVALID_SHADER_PROGRAM_ID, INVALID_SHADER_PROGRAM_ID};
+  ShaderProgramId &boundProgram(vk::PipelineBindPoint bind_point)
+  {
+    ETNA_ASSERT(bind_point == vk::PipelineBindPoint::eGraphics || bind_point == vk::PipelineBindPoint::eCompute);
+    return boundPrograms[bind_point == vk::PipelineBindPoint::eGraphics ? 0 : 1];
+  }
+
+  // Sets stay bound when the pipeline changes, their states are requested again for the new program
+  using BoundSets = std::array<std::optional<DescriptorSet>, MAX_PROGRAM_DESCRIPTORS>;
+  std::array<BoundSets, 2> boundSets;
+  BoundSets &boundSetsFor(vk::PipelineBindPoint bind_point)
+  {
+    return boundSets[bind_point == vk::PipelineBindPoint::eGraphics ? 0 : 1];
+  }
+
+  StateRequests transferRequests; // reused to not allocate for every command
+  std::vector<std::function<void(vk::CommandBuffer)>> batchedCommands;
+
+  // split barrier events, reset when the command buffer is reset
+  std::vector<vk::UniqueEvent> events;
+  uint32_t usedEvents = 0;
+
+  // What is bound by this command buffer, for state filtering.
+  // requestedAt is flushCount when states of the binding were requested, NOT_REQUESTED if they weren't
+  struct BoundState
+  {
+    static constexpr uint64_t NOT_REQUESTED = ~0ull;
+
+    struct Set
+    {
+      vk::DescriptorSet set {};
+      vk::PipelineLayout layout {};
+      ShaderProgramId program = INVALID_SHADER_PROGRAM_ID; // selected binding stages of requests
+      uint64_t requestedAt = NOT_REQUESTED;
+    };
+
+    struct BufferBinding
+    {
+      ResourceId buffer = INVALID_RESOURCE_ID;
+      vk::DeviceSize offset = 0;
+      vk::IndexType type {};
+      uint64_t requestedAt = NOT_REQUESTED;
+    };
+
+    vk::Pipeline pipeline {};
+    std::array<Set, MAX_PROGRAM_DESCRIPTORS> sets {};
+    std::array<BufferBinding, 16> vertexBuffers {}; // higher bindings are not filtered
+    BufferBinding indexBuffer {};
+    uint32_t firstViewport = 0;
+    std::vector<vk::Viewport> viewports;
+    uint32_t firstScissor = 0;
+    std::vector<vk::Rect2D> scissors;
+
+    void clear()
+    {
+      pipeline = vk::Pipeline {};
+      sets.fill(Set {});
+      vertexBuffers.fill(BufferBinding {});
+      indexBuffer = BufferBinding {};
+      viewports.clear();
+      scissors.clear();
+    }
+  };
+
+  BoundState renderBound; // cleared at beginRendering
+  BoundState computeBound; // cleared after secondaries are executed, they leave it undefined
+  BoundState &boundState(vk::PipelineBindPoint bind_point)
+  {
+    return bind_point == vk::PipelineBindPoint::eGraphics? renderBound : computeBound;
+  }
+  uint64_t flushCount = 0; // requests are consumed by every barrier flush
+  StateFilterStats filterStats;
+  bool stateFiltering = false;
+
+  bool fixupOnSubmit = false;
+  bool secondaryRenderPasses = false;
+  bool unsynchronized = false; // inside beginUnsynchronized/endUnsynchronized
 };
 
 
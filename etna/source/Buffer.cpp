@@ -9,7 +9,7 @@ namespace etna
 {
 
 Buffer::Buffer(VmaAllocator alloc, CreateInfo info)
-  : allocator{alloc}, size{info.size}
+  : allocator{alloc}, id{tracking::allocate_resource_id()}, size{info.size}
 {
   vk::BufferCreateInfo buf_info{
     .size = info.size,
@@ -45,6 +45,7 @@ void Buffer::swap(Buffer& other)
   std::swap(allocator, other.allocator);
   std::swap(allocation, other.allocation);
   std::swap(buffer, other.buffer);
+  std::swap(id, other.id);
   std::swap(mapped, other.mapped);
   std::swap(size, other.size);
 }
@@ -75,8 +76,8 @@ void Buffer::reset()
   if (!buffer)
     return;
 
-  etna::get_context().getQueueTrackingState()
-    .onResourceDeletion(tracking::to_handle(*this));
+  // drops the states kept by queues through the deletion handler
+  tracking::free_resource_id(id);
 
   if (mapped != nullptr)
     unmap();
@@ -85,6 +86,7 @@ void Buffer::reset()
   allocator = {};
   allocation = {};
   buffer = vk::Buffer{};
+  id = INVALID_RESOURCE_ID;
   size = 0;
 }
 
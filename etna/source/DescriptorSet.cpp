@@ -185,6 +185,7 @@ namespace etna
       if (is_image_resource(bindingInfo.descriptorType))
       {
         auto img = std::get<ImageBinding>(binding.resources).descriptor_info;
+        img.imageLayout = tracking::apply_layout_policy(get_context().getLayoutPolicy(), img.imageLayout);
         imageInfos[numImageInfo] = img;
         write.setPImageInfo(imageInfos.data() + numImageInfo);
         numImageInfo++;
@@ -238,7 +239,7 @@ namespace etna
       {vk::DescriptorType::eUniformBuffer, vk::AccessFlagBits2::eUniformRead},
       {vk::DescriptorType::eUniformBufferDynamic, vk::AccessFlagBits2::eUniformRead},
 
-      //one flag may be ok here. TODO : more info about bindings
+      // narrowed by NonWritable/NonReadable decorations of the bound program in binding_access
       {vk::DescriptorType::eStorageBuffer, vk::AccessFlagBits2::eShaderStorageRead|vk::AccessFlagBits2::eShaderStorageWrite},
       {vk::DescriptorType::eStorageBufferDynamic, vk::AccessFlagBits2::eShaderStorageRead|vk::AccessFlagBits2::eShaderStorageWrite},
       {vk::DescriptorType::eStorageImage, vk::AccessFlagBits2::eShaderStorageRead|vk::AccessFlagBits2::eShaderStorageWrite},
@@ -257,24 +258,42 @@ namespace etna
     return {};
   }
 
-  void DescriptorSet::requestStates(CmdBufferTrackingState &state) const
+  // without usage of the binding by the bound program both storage read and write are assumed
+  static vk::AccessFlags2 binding_access(vk::DescriptorType type, 
+    std::span<const vk::AccessFlags2> storage_access, uint32_t binding)
+  {
+    auto access = descriptor_type_to_access_flag(type);
+    if (binding < storage_access.size() && storage_access[binding])
+    {
+      const vk::AccessFlags2 storage = vk::AccessFlagBits2::eShaderStorageRead | vk::AccessFlagBits2::eShaderStorageWrite;
+      access &= ~storage | storage_access[binding];
+    }
+    return access;
+  }
+
+  void DescriptorSet::requestStates(CmdBufferTrackingState &state,
+    std::span<const vk::ShaderStageFlags> binding_stages, std::span<const vk::AccessFlags2> binding_storage_access) const
   {
     auto &layoutInfo = get_context().getDescriptorSetLayouts().getLayoutInfo(layoutId);
     for (auto &binding : bindings)
     {
       auto &bindingInfo = layoutInfo.getBinding(binding.binding);
+      // bindings added by patch callbacks are not referenced by shaders, keep layout stages for them
+      auto stages = bindingInfo.stageFlags;
+      if (binding.binding < binding_stages.size() && binding_stages[binding.binding])
+        stages = binding_stages[binding.binding];
 
       if (auto image = std::get_if<ImageBinding>(&binding.resources))
       {
         state.requestState(
-          image->image, 
-          image->range.baseMipLevel, 
+          image->image,
+          image->range.baseMipLevel,
           image->range.levelCount,
           image->range.baseArrayLayer,
           image->range.layerCount,
           ImageSubresState {
-            .activeStages = shader_stage_to_pipeline_stage(bindingInfo.stageFlags),
-            .activeAccesses = descriptor_type_to_access_flag(bindingInfo.descriptorType),
+            .activeStages = shader_stage_to_pipeline_stage(stages),
+            .activeAccesses = binding_access(bindingInfo.descriptorType, binding_storage_access, binding.binding),
             .layout = image->descriptor_info.imageLayout
           });
       }
@@ -282,9 +301,11 @@ namespace etna
       {
         state.requestState(
           buffer->buffer,
+          buffer->descriptor_info.offset,
+          buffer->descriptor_info.range,
           BufferState {
-            .activeStages = shader_stage_to_pipeline_stage(bindingInfo.stageFlags),
-            .activeAccesses = descriptor_type_to_access_flag(bindingInfo.descriptorType)
+            .activeStages = shader_stage_to_pipeline_stage(stages),
+            .activeAccesses = binding_access(bindingInfo.descriptorType, binding_storage_access, binding.binding)
           });
       }
     }
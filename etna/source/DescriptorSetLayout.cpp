@@ -5,7 +5,8 @@
 
 namespace etna
 {
-  void DescriptorSetInfo::addResource(const vk::DescriptorSetLayoutBinding &binding)
+  void DescriptorSetInfo::addResource(const vk::DescriptorSetLayoutBinding &binding,
+    bool non_writable, bool non_readable)
   {
     uint32_t index = binding.binding;
     if (index > MAX_DESCRIPTOR_BINDINGS)
@@ -21,10 +22,14 @@ namespace etna
       }
 
       src.stageFlags |= binding.stageFlags;
+      nonWritable[index] = nonWritable[index] && non_writable;
+      nonReadable[index] = nonReadable[index] && non_readable;
       return;
     }
     
     bindings[index] = binding;
+    nonWritable[index] = non_writable;
+    nonReadable[index] = non_readable;
     maxUsedBinding = std::max(maxUsedBinding, index + 1);
   }
   
@@ -33,6 +38,25 @@ namespace etna
     maxUsedBinding = 0;
     for (auto &binding : bindings)
       binding = std::nullopt;
+    nonWritable.reset();
+    nonReadable.reset();
+  }
+
+  // glslang puts readonly/writeonly of buffer blocks on every member instead of the variable
+  static bool has_decoration(const SpvReflectDescriptorBinding &binding, SpvReflectDecorationFlagBits decoration)
+  {
+    if ((binding.decoration_flags | binding.block.decoration_flags) & decoration)
+      return true;
+
+    if (binding.block.member_count == 0)
+      return false;
+
+    for (uint32_t i = 0; i < binding.block.member_count; i++)
+    {
+      if (!(binding.block.members[i].decoration_flags & decoration))
+        return false;
+    }
+    return true;
   }
 
   void DescriptorSetInfo::parseShader(vk::ShaderStageFlagBits stage, const SpvReflectDescriptorSet &spv)
@@ -52,7 +76,9 @@ namespace etna
       apiBinding.stageFlags = stage;
       apiBinding.pImmutableSamplers = nullptr;
       apiBinding.binding = spvBinding.binding;
-      addResource(apiBinding);
+      addResource(apiBinding,
+        has_decoration(spvBinding, SPV_REFLECT_DECORATION_NON_WRITABLE),
+        has_decoration(spvBinding, SPV_REFLECT_DECORATION_NON_READABLE));
     }
   }
   
@@ -62,7 +88,7 @@ namespace etna
     {
       if (!info.bindings[binding].has_value())
         continue;
-      addResource(*info.bindings[binding]);
+      addResource(*info.bindings[binding], info.nonWritable[binding], info.nonReadable[binding]);
     }
   }
 
@@ -9,6 +9,8 @@
 #include <unordered_set>
 #include <vulkan/vulkan_structs.hpp>
 #include <string>
+#include <string_view>
+#include <algorithm>
 
 namespace etna
 {
@@ -132,30 +134,47 @@ namespace etna
     {
       const auto &props = queueFamilies[i];
 
-      if (props.queueCount > 0 && (props.queueFlags & flags))
+      if (props.queueCount > 0 && (props.queueFlags & flags) == flags)
         return i;
     }
 
     ETNA_PANIC("Could not find a queue family that supports all requested flags!");
   }
+
+  // family which supports requested flags and none of the excluded ones
+  static std::optional<uint32_t> findDedicatedQueueFamily(vk::PhysicalDevice pdevice,
+    vk::QueueFlags flags, vk::QueueFlags excluded)
+  {
+    std::vector queueFamilies = pdevice.getQueueFamilyProperties();
+
+    for (uint32_t i = 0; i < queueFamilies.size(); ++i)
+    {
+      const auto &props = queueFamilies[i];
+
+      if (props.queueCount > 0 && (props.queueFlags & flags) == flags && !(props.queueFlags & excluded))
+        return i;
+    }
+    return std::nullopt;
+  }
   
   static vk::UniqueDevice createDevice(vk::PhysicalDevice pdevice,
-    uint32_t universalQueueFamily, const InitParams &params)
+    std::span<const uint32_t> queueFamilies, const InitParams &params, bool draw_indirect_count)
   {
     const float defaultQueuePriority {0.0f};
 
-    // For now we use a single universal queue for everything.
+    // One queue per family: universal one and dedicated async compute/transfer ones if present.
     // Also, it's up to the framework to decide what queueus it needs and supports.
 
-    const std::array queueInfos
-      {
-        vk::DeviceQueueCreateInfo
+    std::vector<vk::DeviceQueueCreateInfo> queueInfos;
+    for (uint32_t family : queueFamilies)
+    {
+      queueInfos.push_back(vk::DeviceQueueCreateInfo
         {
-          .queueFamilyIndex = universalQueueFamily,
+          .queueFamilyIndex = family,
           .queueCount = 1,
           .pQueuePriorities = &defaultQueuePriority,
-        },
-      };
+        });
+    }
 
     vk::PhysicalDeviceDynamicRenderingFeatures dynamic_rendering_feature {
       // Evil const cast due to C not having const
@@ -163,13 +182,29 @@ namespace etna
       .dynamicRendering = VK_TRUE
     };
 
-    vk::PhysicalDeviceSynchronization2Features sync2_feature {
+    // depth and stencil aspects are tracked and transitioned separately
+    vk::PhysicalDeviceSeparateDepthStencilLayoutsFeatures separate_depth_stencil_feature {
       .pNext = &dynamic_rendering_feature,
+      .separateDepthStencilLayouts = VK_TRUE
+    };
+
+    // cross-queue dependencies of ownership transfers
+    vk::PhysicalDeviceTimelineSemaphoreFeatures timeline_semaphore_feature {
+      .pNext = &separate_depth_stencil_feature,
+      .timelineSemaphore = VK_TRUE
+    };
+
+    vk::PhysicalDeviceSynchronization2Features sync2_feature {
+      .pNext = &timeline_semaphore_feature,
       .synchronization2 = VK_TRUE
     };
 
     std::vector<char const *> deviceExtensions(params.deviceExtensions.begin(), params.deviceExtensions.end());
     deviceExtensions.push_back(VK_KHR_DYNAMIC_RENDERING_EXTENSION_NAME);
+    // may be requested by the application as well
+    if (draw_indirect_count && std::find_if(deviceExtensions.begin(), deviceExtensions.end(),
+      [](const char *name) { return std::string_view {name} == VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME; }) == deviceExtensions.end())
+      deviceExtensions.push_back(VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME);
     #ifdef DEBUG_NAMES
     deviceExtensions.push_back(VK_EXT_DEBUG_MARKER_EXTENSION_NAME);
     #endif
@@ -191,6 +226,88 @@ namespace etna
       }).value;
   }
   
+  static QueueContext createQueueContext(vk::Device device, uint32_t family)
+  {
+    vk::SemaphoreTypeCreateInfo timelineInfo {
+      .semaphoreType = vk::SemaphoreType::eTimeline,
+      .initialValue = 0
+    };
+
+    vk::CommandPoolCreateInfo poolInfo {
+      .flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+      .queueFamilyIndex = family
+    };
+
+    return QueueContext {
+      .queue = device.getQueue(family, 0),
+      .familyIdx = family,
+      .tracking = QueueTrackingState{family},
+      .timeline = device.createSemaphoreUnique(vk::SemaphoreCreateInfo{.pNext = &timelineInfo}).value,
+      .internalPool = device.createCommandPoolUnique(poolInfo).value
+    };
+  }
+
+  vk::CommandBuffer QueueContext::beginInternalCmd()
+  {
+    auto device = etna::get_context().getDevice();
+    auto [result, completed] = device.getSemaphoreCounterValue(timeline.get());
+    ETNA_ASSERT(result == vk::Result::eSuccess);
+
+    auto it = std::find_if(internalCmds.begin(), internalCmds.end(), 
+      [&](const auto &cmd) { return cmd.second <= completed; });
+    if (it == internalCmds.end())
+    {
+      vk::CommandBufferAllocateInfo info {
+        .commandPool = internalPool.get(),
+        .level = vk::CommandBufferLevel::ePrimary,
+        .commandBufferCount = 1
+      };
+      internalCmds.emplace_back(std::move(device.allocateCommandBuffersUnique(info).value[0]), 0);
+      it = std::prev(internalCmds.end());
+    }
+
+    it->second = ++timelineValue;
+    auto cmd = it->first.get();
+    ETNA_ASSERT(cmd.reset() == vk::Result::eSuccess);
+    ETNA_ASSERT(cmd.begin(vk::CommandBufferBeginInfo{
+      .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit}) == vk::Result::eSuccess);
+    return cmd;
+  }
+
+  std::pair<vk::CommandBuffer, uint64_t> QueueContext::recordPrologue(tracking::CmdBarrier &barrier)
+  {
+    auto cmd = beginInternalCmd();
+    barrier.flush(cmd);
+    ETNA_ASSERT(cmd.end() == vk::Result::eSuccess);
+    return {cmd, timelineValue};
+  }
+
+  uint64_t QueueContext::submitRelease(const tracking::OwnershipRelease &release)
+  {
+    auto cmd = beginInternalCmd();
+
+    vk::DependencyInfo dependency {};
+    dependency.setBufferMemoryBarriers(release.bufferBarriers);
+    dependency.setImageMemoryBarriers(release.imageBarriers);
+    cmd.pipelineBarrier2(dependency);
+    ETNA_ASSERT(cmd.end() == vk::Result::eSuccess);
+
+    vk::CommandBufferSubmitInfo cmdInfo {
+      .commandBuffer = cmd
+    };
+    vk::SemaphoreSubmitInfo signalInfo {
+      .semaphore = timeline.get(),
+      .value = timelineValue,
+      .stageMask = vk::PipelineStageFlagBits2::eAllCommands
+    };
+
+    vk::SubmitInfo2 submitInfo {};
+    submitInfo.setCommandBufferInfos(cmdInfo);
+    submitInfo.setSignalSemaphoreInfos(signalInfo);
+    ETNA_ASSERT(queue.submit2({submitInfo}) == vk::Result::eSuccess);
+    return timelineValue;
+  }
+
 #ifndef NDEBUG
   static VkBool32 debugCallback(
     VkDebugUtilsMessageSeverityFlagBitsEXT messageSeverity,
@@ -221,6 +338,7 @@ namespace etna
 
   GlobalContext::GlobalContext(const InitParams &params)
     : numFramesInFlight {params.numFramesInFlight}
+    , layoutPolicy {params.layoutPolicy}
   {
     // Proper initialization of vulkan is tricky, as we need to
     // dynamically link vulkan-1.dll and load symbols for various
@@ -260,11 +378,49 @@ namespace etna
 
     constexpr auto UNIVERSAL_QUEUE_FLAGS =
       vk::QueueFlagBits::eGraphics | vk::QueueFlagBits::eCompute | vk::QueueFlagBits::eTransfer;
-    universalQueueFamilyIdx = getQueueFamilyIndex(vkPhysDevice, UNIVERSAL_QUEUE_FLAGS);
-    vkDevice = createDevice(vkPhysDevice, universalQueueFamilyIdx, params);
+    const uint32_t universalQueueFamilyIdx = getQueueFamilyIndex(vkPhysDevice, UNIVERSAL_QUEUE_FLAGS);
+
+    const std::array<uint32_t, QUEUE_TYPE_COUNT> typeFamilies {
+      universalQueueFamilyIdx,
+      findDedicatedQueueFamily(vkPhysDevice, vk::QueueFlagBits::eCompute, vk::QueueFlagBits::eGraphics)
+        .value_or(universalQueueFamilyIdx),
+      findDedicatedQueueFamily(vkPhysDevice, vk::QueueFlagBits::eTransfer, 
+        vk::QueueFlagBits::eGraphics | vk::QueueFlagBits::eCompute).value_or(universalQueueFamilyIdx)
+    };
+
+    std::vector<uint32_t> queueFamilies;
+    for (uint32_t i = 0; i < QUEUE_TYPE_COUNT; i++)
+    {
+      auto it = std::find(queueFamilies.begin(), queueFamilies.end(), typeFamilies[i]);
+      queueIndices[i] = static_cast<uint32_t>(std::distance(queueFamilies.begin(), it));
+      if (it == queueFamilies.end())
+        queueFamilies.push_back(typeFamilies[i]);
+    }
+
+    // optional, the drawIndirectCount feature of Vulkan 1.2 is not guaranteed either
+    std::array drawIndirectCountExtension {VK_KHR_DRAW_INDIRECT_COUNT_EXTENSION_NAME};
+    drawIndirectCount = checkPhysicalDeviceSupportsExtensions(vkPhysDevice, drawIndirectCountExtension);
+
+    vkDevice = createDevice(vkPhysDevice, queueFamilies, params, drawIndirectCount);
     VULKAN_HPP_DEFAULT_DISPATCHER.init(vkDevice.get());
 
-    universalQueue = vkDevice->getQueue(universalQueueFamilyIdx, 0);
+    queues.reserve(queueFamilies.size());
+    for (uint32_t family : queueFamilies)
+      queues.push_back(createQueueContext(vkDevice.get(), family));
+
+    // resources move between queues of different families with ownership transfers
+    for (auto &queue : queues)
+    {
+      for (auto &peer : queues)
+      {
+        if (&queue != &peer)
+          queue.tracking.addPeer(&peer.tracking);
+      }
+    }
+    // Image and Buffer don't know the context, freeing their ids drops states kept by the queues
+    tracking::set_resource_deletion_handler([this](ResourceId id) { onResourceDeletion(id); });
+    spdlog::info("Queue families: universal {}, compute {}, transfer {}", 
+      typeFamilies[0], typeFamilies[1], typeFamilies[2]);
 
     {
       // VmaVulkanFunctions vulkanFunctions {};
@@ -309,10 +465,29 @@ namespace etna
     return Buffer(vmaAllocator.get(), info);
   }
 
-  QueueTrackingState &GlobalContext::getQueueTrackingState()
+  QueueTrackingState &GlobalContext::getQueueTrackingState(QueueType type)
   {
-    return queueTracking;
+    return getQueueContext(type).tracking;
   }
 
-  GlobalContext::~GlobalContext() = default;
+  QueueContext &GlobalContext::getQueueContext(const QueueTrackingState &tracking)
+  {
+    for (auto &queue : queues)
+    {
+      if (&queue.tracking == &tracking)
+        return queue;
+    }
+    ETNA_PANIC("Queue tracking state does not belong to any queue!");
+  }
+
+  void GlobalContext::onResourceDeletion(ResourceId id)
+  {
+    for (auto &queue : queues)
+      queue.tracking.onResourceDeletion(id);
+  }
+
+  GlobalContext::~GlobalContext()
+  {
+    tracking::set_resource_deletion_handler({});
+  }
 }
@@ -90,7 +90,7 @@ ImageCreateInfo ImageCreateInfo::image2D(uint32_t w, uint32_t h, vk::Format fmt,
 
 
 Image::Image(VmaAllocator alloc, ImageCreateInfo &&info)
-  : allocator{alloc}, imageInfo{std::move(info)}
+  : allocator{alloc}, id{tracking::allocate_resource_id()}, imageInfo{std::move(info)}
 {
   vk::ImageCreateInfo image_info = imageInfo.toVkInfo();
 
@@ -119,7 +119,8 @@ Image::Image(VmaAllocator alloc, ImageCreateInfo &&info)
 }
 
 Image::Image(vk::Image apiImage, ImageCreateInfo &&info)
-  : allocator{nullptr}, allocation {nullptr}, image{apiImage}, imageInfo{std::move(info)}
+  : allocator{nullptr}, allocation {nullptr}, image{apiImage}, 
+    id{tracking::allocate_resource_id()}, imageInfo{std::move(info)}
 {}
 
 void Image::swap(Image& other)
@@ -127,6 +128,7 @@ void Image::swap(Image& other)
   std::swap(allocator, other.allocator);
   std::swap(allocation, other.allocation);
   std::swap(image, other.image);
+  std::swap(id, other.id);
   std::swap(imageInfo, other.imageInfo);
 }
 
@@ -151,8 +153,8 @@ void Image::reset()
   if (!image)
     return;
   
-  etna::get_context().getQueueTrackingState()
-    .onResourceDeletion(tracking::to_handle(*this));
+  // drops the states kept by queues through the deletion handler
+  tracking::free_resource_id(id);
 
   views.clear();
   if (allocator && allocation)
@@ -160,6 +162,7 @@ void Image::reset()
   allocator = {};
   allocation = {};
   image = vk::Image{};
+  id = INVALID_RESOURCE_ID;
   imageInfo = {};
 }
 
@@ -179,6 +182,8 @@ static vk::ImageAspectFlags get_aspeck_mask(vk::Format format)
   case vk::Format::eD24UnormS8Uint:
   case vk::Format::eD32SfloatS8Uint:
     return vk::ImageAspectFlagBits::eDepth | vk::ImageAspectFlagBits::eStencil;
+  case vk::Format::eS8Uint:
+    return vk::ImageAspectFlagBits::eStencil;
   default:
     return vk::ImageAspectFlagBits::eColor;
   }
@@ -0,0 +1,281 @@
+#include "etna/RenderCommandStream.hpp"
+
+namespace etna
+{
+
+namespace
+{
+  struct BindPipelineCmd
+  {
+    vk::PipelineBindPoint bindPoint;
+    vk::Pipeline pipeline;
+  };
+
+  struct BindDescriptorSetCmd // followed by dynamic offsets
+  {
+    vk::PipelineBindPoint bindPoint;
+    uint32_t setIndex;
+    uint32_t dynamicOffsetsCount;
+    vk::PipelineLayout layout;
+    vk::DescriptorSet set;
+  };
+
+  struct PushConstantsCmd // followed by data
+  {
+    vk::PipelineLayout layout;
+    vk::ShaderStageFlags stages;
+    uint32_t offset;
+    uint32_t size;
+  };
+
+  struct BindVertexBufferCmd
+  {
+    uint32_t bindingIndex;
+    vk::Buffer buffer;
+    vk::DeviceSize offset;
+  };
+
+  struct BindIndexBufferCmd
+  {
+    vk::Buffer buffer;
+    vk::DeviceSize offset;
+    vk::IndexType type;
+  };
+
+  struct DrawCmd
+  {
+    uint32_t vertexCount;
+    uint32_t instanceCount;
+    uint32_t firstVertex;
+    uint32_t firstInstance;
+  };
+
+  struct DrawIndexedCmd
+  {
+    uint32_t indexCount;
+    uint32_t instanceCount;
+    uint32_t firstIndex;
+    int32_t vertexOffset;
+    uint32_t firstInstance;
+  };
+
+  struct DrawIndirectCmd
+  {
+    vk::Buffer buffer;
+    vk::DeviceSize offset;
+    uint32_t drawCount;
+    uint32_t stride;
+  };
+
+  struct DrawIndirectCountCmd
+  {
+    vk::Buffer buffer;
+    vk::DeviceSize offset;
+    vk::Buffer countBuffer;
+    vk::DeviceSize countOffset;
+    uint32_t maxDrawCount;
+    uint32_t stride;
+  };
+
+  struct SetRectsCmd // followed by viewports or scissors
+  {
+    uint32_t first;
+    uint32_t count;
+  };
+
+  template <typename T>
+  T read(const std::byte *src)
+  {
+    T out;
+    std::memcpy(&out, src, sizeof(T));
+    return out;
+  }
+
+  // Trailing arrays start at 4-byte aligned offsets of the 8-byte aligned arena,
+  // they were copied there as whole objects and are used in place
+  template <typename T>
+  const T *trailing(const std::byte *payload, size_t command_size)
+  {
+    static_assert(alignof(T) <= 4);
+    return reinterpret_cast<const T *>(payload + command_size);
+  }
+}
+
+void RenderCommandStream::bindPipeline(vk::PipelineBindPoint bind_point, vk::Pipeline pipeline)
+{
+  write(Op::BindPipeline, BindPipelineCmd {bind_point, pipeline});
+}
+
+void RenderCommandStream::bindDescriptorSet(vk::PipelineBindPoint bind_point, vk::PipelineLayout layout,
+  uint32_t set_index, vk::DescriptorSet set, std::span<const uint32_t> dynamic_offsets)
+{
+  BindDescriptorSetCmd command {bind_point, set_index, static_cast<uint32_t>(dynamic_offsets.size()), layout, set};
+  write(Op::BindDescriptorSet, command, dynamic_offsets.data(), dynamic_offsets.size_bytes());
+}
+
+void RenderCommandStream::pushConstants(vk::PipelineLayout layout, vk::ShaderStageFlags stages,
+  uint32_t offset, uint32_t size, const void *data)
+{
+  write(Op::PushConstants, PushConstantsCmd {layout, stages, offset, size}, data, size);
+}
+
+void RenderCommandStream::bindVertexBuffer(uint32_t binding_index, vk::Buffer buffer, vk::DeviceSize offset)
+{
+  write(Op::BindVertexBuffer, BindVertexBufferCmd {binding_index, buffer, offset});
+}
+
+void RenderCommandStream::bindIndexBuffer(vk::Buffer buffer, vk::DeviceSize offset, vk::IndexType type)
+{
+  write(Op::BindIndexBuffer, BindIndexBufferCmd {buffer, offset, type});
+}
+
+void RenderCommandStream::draw(uint32_t vertex_count, uint32_t instance_count,
+  uint32_t first_vertex, uint32_t first_instance)
+{
+  write(Op::Draw, DrawCmd {vertex_count, instance_count, first_vertex, first_instance});
+}
+
+void RenderCommandStream::drawIndexed(uint32_t index_count, uint32_t instance_count,
+  uint32_t first_index, int32_t vertex_offset, uint32_t first_instance)
+{
+  write(Op::DrawIndexed, DrawIndexedCmd {index_count, instance_count, first_index, vertex_offset, first_instance});
+}
+
+void RenderCommandStream::drawIndirect(vk::Buffer buffer, vk::DeviceSize offset, uint32_t draw_count, uint32_t stride)
+{
+  write(Op::DrawIndirect, DrawIndirectCmd {buffer, offset, draw_count, stride});
+}
+
+void RenderCommandStream::drawIndexedIndirect(vk::Buffer buffer, vk::DeviceSize offset,
+  uint32_t draw_count, uint32_t stride)
+{
+  write(Op::DrawIndexedIndirect, DrawIndirectCmd {buffer, offset, draw_count, stride});
+}
+
+void RenderCommandStream::drawIndirectCount(vk::Buffer buffer, vk::DeviceSize offset, vk::Buffer count_buffer,
+  vk::DeviceSize count_offset, uint32_t max_draw_count, uint32_t stride)
+{
+  write(Op::DrawIndirectCount,
+    DrawIndirectCountCmd {buffer, offset, count_buffer, count_offset, max_draw_count, stride});
+}
+
+void RenderCommandStream::drawIndexedIndirectCount(vk::Buffer buffer, vk::DeviceSize offset, vk::Buffer count_buffer,
+  vk::DeviceSize count_offset, uint32_t max_draw_count, uint32_t stride)
+{
+  write(Op::DrawIndexedIndirectCount,
+    DrawIndirectCountCmd {buffer, offset, count_buffer, count_offset, max_draw_count, stride});
+}
+
+void RenderCommandStream::setViewport(uint32_t first_viewport, std::span<const vk::Viewport> viewports)
+{
+  SetRectsCmd command {first_viewport, static_cast<uint32_t>(viewports.size())};
+  write(Op::SetViewport, command, viewports.data(), viewports.size_bytes());
+}
+
+void RenderCommandStream::setScissor(uint32_t first_scissor, std::span<const vk::Rect2D> scissors)
+{
+  SetRectsCmd command {first_scissor, static_cast<uint32_t>(scissors.size())};
+  write(Op::SetScissor, command, scissors.data(), scissors.size_bytes());
+}
+
+void RenderCommandStream::replay(vk::CommandBuffer cmd, bool state_only) const
+{
+  const std::byte *ptr = arena.data();
+  const std::byte *end = ptr + arena.size();
+  while (ptr < end)
+  {
+    auto header = read<Header>(ptr);
+    const std::byte *payload = ptr + sizeof(Header);
+    ptr = payload + header.size;
+    bool draw = header.op == Op::Draw || header.op == Op::DrawIndexed
+      || header.op == Op::DrawIndirect || header.op == Op::DrawIndexedIndirect
+      || header.op == Op::DrawIndirectCount || header.op == Op::DrawIndexedIndirectCount;
+    if (state_only && draw)
+      continue;
+
+    switch (header.op)
+    {
+    case Op::BindPipeline:
+    {
+      auto c = read<BindPipelineCmd>(payload);
+      cmd.bindPipeline(c.bindPoint, c.pipeline);
+      break;
+    }
+    case Op::BindDescriptorSet:
+    {
+      auto c = read<BindDescriptorSetCmd>(payload);
+      auto offsets = trailing<uint32_t>(payload, sizeof(c));
+      cmd.bindDescriptorSets(c.bindPoint, c.layout, c.setIndex, 1, &c.set, c.dynamicOffsetsCount, offsets);
+      break;
+    }
+    case Op::PushConstants:
+    {
+      auto c = read<PushConstantsCmd>(payload);
+      cmd.pushConstants(c.layout, c.stages, c.offset, c.size, payload + sizeof(c));
+      break;
+    }
+    case Op::BindVertexBuffer:
+    {
+      auto c = read<BindVertexBufferCmd>(payload);
+      cmd.bindVertexBuffers(c.bindingIndex, {c.buffer}, {c.offset});
+      break;
+    }
+    case Op::BindIndexBuffer:
+    {
+      auto c = read<BindIndexBufferCmd>(payload);
+      cmd.bindIndexBuffer(c.buffer, c.offset, c.type);
+      break;
+    }
+    case Op::Draw:
+    {
+      auto c = read<DrawCmd>(payload);
+      cmd.draw(c.vertexCount, c.instanceCount, c.firstVertex, c.firstInstance);
+      break;
+    }
+    case Op::DrawIndexed:
+    {
+      auto c = read<DrawIndexedCmd>(payload);
+      cmd.drawIndexed(c.indexCount, c.instanceCount, c.firstIndex, c.vertexOffset, c.firstInstance);
+      break;
+    }
+    case Op::DrawIndirect:
+    {
+      auto c = read<DrawIndirectCmd>(payload);
+      cmd.drawIndirect(c.buffer, c.offset, c.drawCount, c.stride);
+      break;
+    }
+    case Op::DrawIndexedIndirect:
+    {
+      auto c = read<DrawIndirectCmd>(payload);
+      cmd.drawIndexedIndirect(c.buffer, c.offset, c.drawCount, c.stride);
+      break;
+    }
+    case Op::DrawIndirectCount:
+    {
+      auto c = read<DrawIndirectCountCmd>(payload);
+      cmd.drawIndirectCountKHR(c.buffer, c.offset, c.countBuffer, c.countOffset, c.maxDrawCount, c.stride);
+      break;
+    }
+    case Op::DrawIndexedIndirectCount:
+    {
+      auto c = read<DrawIndirectCountCmd>(payload);
+      cmd.drawIndexedIndirectCountKHR(c.buffer, c.offset, c.countBuffer, c.countOffset, c.maxDrawCount, c.stride);
+      break;
+    }
+    case Op::SetViewport:
+    {
+      auto c = read<SetRectsCmd>(payload);
+      cmd.setViewport(c.first, c.count, trailing<vk::Viewport>(payload, sizeof(c)));
+      break;
+    }
+    case Op::SetScissor:
+    {
+      auto c = read<SetRectsCmd>(payload);
+      cmd.setScissor(c.first, c.count, trailing<vk::Rect2D>(payload, sizeof(c)));
+      break;
+    }
+    }
+  }
+}
+
+}
@@ -8,8 +8,6 @@
 namespace etna
 {
 
-bool RenderTargetState::inScope = false;
-
 RenderTargetState::RenderTargetState(
     SyncCommandBuffer &cmd_,
     vk::Extent2D extent,
@@ -17,9 +15,8 @@ RenderTargetState::RenderTargetState(
     std::optional<RenderingAttachment> depth_attachment)
   : cmd {cmd_}
 {
-  ETNA_ASSERTF(!inScope, "RenderTargetState scopes shouldn't overlap.");
-  inScope = true;
-  
+  // overlapping scopes of one command buffer are caught by beginRendering,
+  // scopes of different command buffers may be recorded on different threads
   vk::Viewport viewport
   {
     .x = 0.0f,
@@ -43,6 +40,5 @@ RenderTargetState::RenderTargetState(
 RenderTargetState::~RenderTargetState()
 {
   cmd.endRendering();
-  inScope = false;
 }
 }
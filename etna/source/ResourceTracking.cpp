@@ -1,133 +1,117 @@
-#include "etna/SyncCommandBuffer.hpp"
-#include "etna/Etna.hpp"
-#include "etna/DescriptorSet.hpp"
-#include "etna/GlobalContext.hpp"
+#include "etna/ResourceTracking.hpp"
+
+#include <mutex>
+#include <tuple>
 
 namespace etna::tracking
 {
 
-ImageState &find_or_add(ResContainer &resources, const Image &image)
+struct ResourceIdAllocator
 {
-  auto handle = to_handle(image);
-  auto it = resources.find(handle);
-  if (it == resources.end())
-    it = resources.emplace(handle, ImageState{image}).first;
-  auto state = std::get_if<ImageState>(&it->second);
-  ETNA_ASSERT(state);
-  return *state;
-}
+  std::mutex lock;
+  uint32_t generation = 0;
+  uint32_t slotsCount = 0;
+  std::vector<uint32_t> freeSlots;
+  std::function<void(ResourceId)> onDeletion;
+};
 
-// acquire logic should be here in request
-BufferState &find_or_add(ResContainer &resources, const Buffer &buffer)
-{
-  auto handle = to_handle(buffer);
-  auto it = resources.find(handle);
-  if (it == resources.end())
-    it = resources.emplace(handle, BufferState{}).first;
-  auto state = std::get_if<BufferState>(&it->second);
-  ETNA_ASSERT(state);
-  return *state;
-}
+static ResourceIdAllocator g_resource_ids {};
 
-void CmdBufferTrackingState::expectState(const Image &image, uint32_t mip, uint32_t layer, ImageSubresState state)
+ResourceId allocate_resource_id()
 {
-  auto &srcState = find_or_add(expectedResources, image).getSubresource(mip, layer);
-  srcState = state;
-}
+  std::lock_guard guard {g_resource_ids.lock};
+  // generation 0 is reserved for INVALID_RESOURCE_ID
+  uint32_t generation = ++g_resource_ids.generation;
+  ETNA_ASSERTF(generation != 0, "Resource id generation overflow");
 
-void CmdBufferTrackingState::expectState(const Buffer &buffer, BufferState state)
-{
-  auto handle = to_handle(buffer);
-  auto it = expectedResources.find(handle);
-  if (it == expectedResources.end())
-    expectedResources.emplace(handle, state);
+  uint32_t slot = g_resource_ids.slotsCount;
+  if (!g_resource_ids.freeSlots.empty())
+  {
+    slot = g_resource_ids.freeSlots.back();
+    g_resource_ids.freeSlots.pop_back();
+  }
   else
-    it->second = state;
-}
-
-void CmdBufferTrackingState::requestState(const Image &image, uint32_t mip, uint32_t layer, ImageSubresState state)
-{
-  auto &dstState = find_or_add(requests, image).getSubresource(mip, layer);
-  if (!dstState.has_value())
   {
-    dstState = state; //acquire logic should be here
-    return;
+    g_resource_ids.slotsCount++;
   }
 
-  ETNA_ASSERTF(dstState->layout == state.layout, "Different layouts requested for image");
-  dstState->activeAccesses |= state.activeAccesses; // TODO: check if accesses are compatible
-  dstState->activeStages |= state.activeStages;
+  return (ResourceId(generation) << 32) | ResourceId(slot);
 }
 
-void CmdBufferTrackingState::requestState(const Image &image, uint32_t firstMip, uint32_t mipCount, 
-    uint32_t firstLayer, uint32_t layerCount, ImageState::SubresourceState state)
+void free_resource_id(ResourceId id)
 {
-  for (uint32_t mip = firstMip; mip < firstMip + mipCount; mip++)
-  {
-    for (uint32_t layer = firstLayer; layer < firstLayer + layerCount; layer++)
-    {
-      requestState(image, mip, layer, state);
-    }
-  }
+  if (id == INVALID_RESOURCE_ID)
+    return;
+  std::lock_guard guard {g_resource_ids.lock};
+  if (g_resource_ids.onDeletion)
+    g_resource_ids.onDeletion(id);
+  g_resource_ids.freeSlots.push_back(resource_index(id));
 }
 
-void CmdBufferTrackingState::requestState(const Image &image, vk::ImageSubresourceRange range, ImageSubresState state)
+void set_resource_deletion_handler(std::function<void(ResourceId)> handler)
 {
-  requestState(image, range.baseMipLevel, range.levelCount, range.baseArrayLayer, range.layerCount, state);
+  std::lock_guard guard {g_resource_ids.lock};
+  g_resource_ids.onDeletion = std::move(handler);
 }
 
-void CmdBufferTrackingState::requestState(const Buffer &buffer, BufferState state)
+uint32_t &ResContainer::slotFor(ResourceId id)
 {
-  auto &dstState = find_or_add(requests, buffer);
-  dstState.activeAccesses |= state.activeAccesses;
-  dstState.activeStages |= state.activeStages;
+  uint32_t slot = resource_index(id);
+  if (slot >= sparse.size())
+    sparse.resize(std::max<std::size_t>(slot + 1, sparse.size() * 2), INVALID_POS);
+  
+  // state of a destroyed resource which had the same slot
+  if (sparse[slot] != INVALID_POS)
+    eraseSlot(slot);
+  return sparse[slot];
 }
 
-void CmdBufferTrackingState::initResourceStates(const ResContainer &states)
+void ResContainer::eraseSlot(uint32_t slot)
 {
-  if (!expectedResources.size())
-  {  
-    expectedResources = states;
-    return;
-  }
+  uint32_t pos = sparse[slot] & ~BUFFER_BIT;
+  bool isBuffer = (sparse[slot] & BUFFER_BIT) != 0;
+  sparse[slot] = INVALID_POS;
 
-  for (auto &[handle, state] : states)
-  {
-    auto it = expectedResources.find(handle);
-    if (it == expectedResources.end())
+  auto swapRemove = [&](auto &ids, auto &states, uint32_t kind) {
+    uint32_t last = static_cast<uint32_t>(ids.size() - 1);
+    if (pos != last)
     {
-      expectedResources.emplace(handle, state);
-      continue;
+      ids[pos] = ids[last];
+      states[pos] = std::move(states[last]);
+      sparse[resource_index(ids[pos])] = pos | kind;
     }
-    
-    ETNA_ASSERT(it->second.index() == state.index());
+    ids.pop_back();
+    states.pop_back();
+  };
 
-    if (auto imageState = std::get_if<ImageState>(&state))
-    {
-      auto &dstState = std::get<ImageState>(it->second);
-      for (uint32_t i = 0; i < imageState->states.size(); i++)
-      {
-        if (imageState->states[i].has_value())
-          dstState.states[i] = imageState->states[i];
-      }
-    }
-    else if (std::holds_alternative<BufferState>(state))
-    {
-      it->second = state;
-    }
-  }
+  if (isBuffer)
+    swapRemove(bufferIds, bufferStates, BUFFER_BIT);
+  else
+    swapRemove(imageIds, imageStates, 0);
+}
 
+ImageState &ResContainer::addImage(ResourceId id, const ImageState &state)
+{
+  ETNA_ASSERT(findImage(id) == nullptr);
+  uint32_t &slot = slotFor(id);
+  slot = static_cast<uint32_t>(imageStates.size());
+  imageIds.push_back(id);
+  return imageStates.emplace_back(state);
 }
 
-void CmdBufferTrackingState::initResourceStates(ResContainer &&states)
+BufferRanges &ResContainer::addBuffer(ResourceId id, const BufferRanges &state)
 {
-  if (!expectedResources.size())
-  {
-    expectedResources = std::move(states);
-    return;
-  }
+  ETNA_ASSERT(findBuffer(id) == nullptr);
+  uint32_t &slot = slotFor(id);
+  slot = static_cast<uint32_t>(bufferStates.size()) | BUFFER_BIT;
+  bufferIds.push_back(id);
+  return bufferStates.emplace_back(state);
+}
 
-  initResourceStates(states);
+void ResContainer::erase(ResourceId id)
+{
+  if (findImage(id) || findBuffer(id))
+    eraseSlot(resource_index(id));
 }
 
 constexpr vk::AccessFlags2 READ_ACCESS_MASK = 
@@ -163,378 +147,1139 @@ static constexpr bool is_write_access(vk::AccessFlags2 flags)
   return (flags & WRITE_ACCESS_MASK) != vk::AccessFlags2{};
 }
 
+static ImageState &find_or_add(ResContainer &resources, const ImageResource &image)
+{
+  if (auto state = resources.findImage(image.id))
+    return *state;
+  return resources.addImage(image.id, ImageState{image});
+}
 
-std::optional<vk::ImageMemoryBarrier2> CmdBufferTrackingState::genBarrier(
-  vk::Image img,
-  vk::ImageAspectFlags aspect,
-  uint32_t mip,
-  uint32_t layer,
-  ImageState::SubresourceState &src,
-  const ImageState::SubresourceState &dst)
+static BufferRanges &find_or_add(ResContainer &resources, const BufferResource &buffer)
 {
-  // write -> write  - barrier, dstStage = only write command, dstAccess=only writes
-  // write -> read   - barrier, dstStage = all commands, dstAccess = memoryRead|memoryWrite
-  // layout change   - barrier, dstStage = all commands, dstAccess = memoryRead|memoryWrite
-  // read -> write   - execution dependency only (but again, with dstStage = all commands :( 
-  // read -> read    - no barrier (thats why dstStages = all commands required)
+  if (auto state = resources.findBuffer(buffer.id))
+    return *state;
+  return resources.addBuffer(buffer.id, BufferRanges{buffer});
+}
 
-  vk::ImageSubresourceRange range {
-    .aspectMask = aspect,
-    .baseMipLevel = mip,
-    .levelCount = 1,
-    .baseArrayLayer = layer,
-    .layerCount = 1
-  };
+// nothing is in flight, everything is visible
+template <typename State>
+static void reset_accesses(State &state)
+{
+  state.activeStages = vk::PipelineStageFlags2{};
+  state.activeAccesses = vk::AccessFlags2{};
+  state.visibleStages = ALL_STAGES;
+  state.visibleAccesses = ALL_ACCESSES;
+  state.event = NO_EVENT;
+}
 
-  //layout change
-  if (src.layout != dst.layout)
-  {
-    auto barrier = vk::ImageMemoryBarrier2 {
-      .srcStageMask = src.activeStages| vk::PipelineStageFlagBits2::eTopOfPipe, // incorrect mask can be here
-      .srcAccessMask = src.activeAccesses & WRITE_ACCESS_MASK, // incorrect mask can be here
-      .dstStageMask = vk::PipelineStageFlagBits2::eAllCommands,
-      .dstAccessMask = vk::AccessFlagBits2::eMemoryRead|vk::AccessFlagBits2::eMemoryWrite,
-      .oldLayout = src.layout,
-      .newLayout = dst.layout,
-      .image = img,
-      .subresourceRange = range
-    };
-    src = dst;
-    return barrier;
-  }
+static void reset_active_states(ResContainer &resources)
+{
+  resources.forEachImage([](ResourceId, ImageState &imageState) {
+    imageState.states.update([](uint32_t, uint32_t, std::optional<ImageSubresState> &substate) {
+      if (substate.has_value())
+        reset_accesses(*substate);
+    });
+  });
+
+  resources.forEachBuffer([](ResourceId, BufferRanges &bufferRanges) {
+    bufferRanges.states.update([](vk::DeviceSize, vk::DeviceSize, std::optional<BufferState> &state) {
+      if (state.has_value())
+        reset_accesses(*state);
+    });
+  });
+}
 
-  bool isSrcWrite = is_write_access(src.activeAccesses);
-  bool isSrcRead = is_read_access(src.activeAccesses);
-  bool isDstWrite = is_write_access(dst.activeAccesses);
-  bool isDstRead = is_read_access(dst.activeAccesses);
+// copies states which have value from src to dst
+template <typename ResourceState>
+static void overlay(ResourceState &dst, const ResourceState &src)
+{
+  src.states.forEach([&](auto begin, auto end, const auto &state) {
+    if (state.has_value())
+      dst.states.assign(begin, end, state);
+  });
+}
 
-  if (isSrcWrite) //barrier required
+vk::ImageLayout aspect_layout(vk::ImageAspectFlags aspect, vk::ImageLayout layout)
+{
+  using L = vk::ImageLayout;
+  if (aspect == vk::ImageAspectFlagBits::eDepth)
   {
-    vk::ImageMemoryBarrier2 barrier {
-      .srcStageMask = src.activeStages,
-      .srcAccessMask = src.activeAccesses & WRITE_ACCESS_MASK, // & writeMask? 
-      .image = img,
-      .subresourceRange = range
-    };
-
-    if (isDstWrite) //write (and maybe read); make available for next command only
+    switch (layout)
     {
-      barrier.dstStageMask = dst.activeStages;
-      barrier.dstAccessMask = dst.activeAccesses;
+    case L::eDepthStencilAttachmentOptimal:
+    case L::eDepthAttachmentStencilReadOnlyOptimal:
+      return L::eDepthAttachmentOptimal;
+    case L::eDepthStencilReadOnlyOptimal:
+    case L::eDepthReadOnlyStencilAttachmentOptimal:
+      return L::eDepthReadOnlyOptimal;
+    default:
+      return layout;
     }
-    else if (isDstRead) // read only. make available for all accesses to not insert barrier between reads
+  }
+
+  if (aspect == vk::ImageAspectFlagBits::eStencil)
+  {
+    switch (layout)
     {
-      barrier.dstStageMask = vk::PipelineStageFlagBits2::eAllCommands;
-      barrier.dstAccessMask = vk::AccessFlagBits2::eMemoryRead|vk::AccessFlagBits2::eMemoryWrite;
+    case L::eDepthStencilAttachmentOptimal:
+    case L::eDepthReadOnlyStencilAttachmentOptimal:
+      return L::eStencilAttachmentOptimal;
+    case L::eDepthStencilReadOnlyOptimal:
+    case L::eDepthAttachmentStencilReadOnlyOptimal:
+      return L::eStencilReadOnlyOptimal;
+    default:
+      return layout;
     }
-    src = dst;
-    return barrier;
   }
+  return layout;
+}
 
-  if (isSrcRead && isDstWrite) // and !isSrcWrite
+vk::ImageLayout apply_layout_policy(LayoutPolicy policy, vk::ImageLayout layout)
+{
+  using L = vk::ImageLayout;
+  switch (policy)
   {
-    vk::ImageMemoryBarrier2 barrier {
-      .srcStageMask = src.activeStages,
-      .srcAccessMask = vk::AccessFlags2{}, // no accesses to make visible  
-      .dstStageMask = dst.activeStages,
-      .dstAccessMask = vk::AccessFlags2{}, // if image was in read state, than it is visible for all accesses
-      .image = img,
-      .subresourceRange = range
-    };
-    src = dst;
-    return barrier;
+  case LayoutPolicy::Exact:
+    return layout;
+  case LayoutPolicy::Unified:
+    switch (layout)
+    {
+    case L::eColorAttachmentOptimal:
+    case L::eDepthStencilAttachmentOptimal:
+    case L::eDepthAttachmentOptimal:
+    case L::eStencilAttachmentOptimal:
+      return L::eAttachmentOptimal;
+    case L::eShaderReadOnlyOptimal:
+    case L::eDepthStencilReadOnlyOptimal:
+    case L::eDepthReadOnlyOptimal:
+    case L::eStencilReadOnlyOptimal:
+      return L::eReadOnlyOptimal;
+    default:
+      return layout; // mixed depth-stencil, transfer and presentation layouts
+    }
+  case LayoutPolicy::General:
+    switch (layout)
+    {
+    case L::eUndefined:
+    case L::ePreinitialized:
+    case L::ePresentSrcKHR:
+    case L::eSharedPresentKHR:
+      return layout;
+    default:
+      return L::eGeneral;
+    }
   }
-  else if (isSrcRead && isDstRead) // and !isDstWrite
+  return layout;
+}
+
+// requests to the same subresources in one flush are merged into one state
+static void merge_request(std::optional<ImageSubresState> &dst, const ImageSubresState &src)
+{
+  if (!dst.has_value())
   {
-    src.activeAccesses |= dst.activeAccesses;
-    src.activeStages |= dst.activeStages;
-    return {};
+    dst = src; //acquire logic should be here
+    return;
   }
 
-  //!isSrcWrite && !isSrcRead -> resource was not used 
-  ETNA_ASSERTF(src.activeAccesses == vk::AccessFlagBits2::eNone, "Unknown resource access");
-  ETNA_ASSERTF(src.activeStages == vk::PipelineStageFlags2{}, "Unknown pipeline stages");
-  // 1) resource was not used yet, but is memory may be used
-  // (it's previous owner was destroyed and it is allocated again)
-  // this should somehow been managed with fences e.t.c
-  // 2) or explicit barrier was called before
-  src = dst;
-  return {};
+  ETNA_ASSERTF(dst->layout == src.layout, "Different layouts requested for image");
+  dst->activeAccesses |= src.activeAccesses; // TODO: check if accesses are compatible
+  dst->activeStages |= src.activeStages;
 }
 
-static void merge(std::optional<vk::MemoryBarrier2> &dst, const vk::MemoryBarrier2 &src)
+static void merge_request(std::optional<BufferState> &dst, const BufferState &src)
 {
-  if (dst.has_value())
+  if (!dst.has_value())
   {
-    dst->srcStageMask |= src.srcStageMask;
-    dst->srcAccessMask |= src.srcAccessMask;
-    dst->dstStageMask |= src.dstStageMask;
-    dst->dstAccessMask |= src.dstAccessMask;
+    dst = src;
     return;
   }
-  *dst = src;
+  dst->activeAccesses |= src.activeAccesses;
+  dst->activeStages |= src.activeStages;
 }
 
-void CmdBufferTrackingState::genBarrier(std::optional<vk::MemoryBarrier2> &barrier,
-    BufferState &src,
-    const BufferState &dst)
+void CmdBufferTrackingState::expectState(const ImageResource &image, uint32_t mip, uint32_t layer, ImageSubresState state)
+{
+  expectState(image, vk::ImageSubresourceRange{
+    .baseMipLevel = mip,
+    .levelCount = 1,
+    .baseArrayLayer = layer,
+    .layerCount = 1
+  }, state);
+}
+
+void CmdBufferTrackingState::expectState(const ImageResource &image, vk::ImageSubresourceRange range, ImageSubresState state)
+{
+  auto &imageState = findOrImportExpected(image.id, ImageState{image});
+  imageState.forEachInterval(range, [&](uint32_t begin, uint32_t end, vk::ImageAspectFlags aspect) {
+    auto planeState = state;
+    planeState.layout = aspect_layout(aspect, mapLayout(state.layout));
+    imageState.states.assign(begin, end, planeState);
+  });
+}
+
+void CmdBufferTrackingState::expectState(const BufferResource &buffer, BufferState state)
+{
+  expectState(buffer, 0, VK_WHOLE_SIZE, state);
+}
+
+void CmdBufferTrackingState::expectState(const BufferResource &buffer, vk::DeviceSize offset, vk::DeviceSize size, 
+  BufferState state)
+{
+  auto &bufferRanges = findOrImportExpected(buffer.id, BufferRanges{buffer});
+  bufferRanges.states.assign(offset, bufferRanges.rangeEnd(offset, size), state);
+}
+
+void CmdBufferTrackingState::requestState(const ImageResource &image, uint32_t mip, uint32_t layer, ImageSubresState state)
+{
+  requestState(image, mip, 1, layer, 1, state);
+}
+
+void CmdBufferTrackingState::requestState(const ImageResource &image, uint32_t firstMip, uint32_t mipCount, 
+    uint32_t firstLayer, uint32_t layerCount, ImageState::SubresourceState state)
+{
+  vk::ImageSubresourceRange range {
+    .baseMipLevel = firstMip,
+    .levelCount = mipCount,
+    .baseArrayLayer = firstLayer,
+    .layerCount = layerCount
+  };
+  requestState(image, range, state);
+}
+
+void CmdBufferTrackingState::requestState(const ImageResource &image, vk::ImageSubresourceRange range, ImageSubresState state)
+{
+  auto &imageState = find_or_add(requests, image);
+  imageState.forEachInterval(range, [&](uint32_t begin, uint32_t end, vk::ImageAspectFlags aspect) {
+    auto planeState = state;
+    planeState.layout = aspect_layout(aspect, mapLayout(state.layout));
+
+    imageState.states.update(begin, end, [&](uint32_t, uint32_t, std::optional<ImageSubresState> &dstState) {
+      merge_request(dstState, planeState);
+    });
+  });
+}
+
+void CmdBufferTrackingState::discard(const ImageResource &image, vk::ImageSubresourceRange range)
+{
+  auto id = image.id;
+  if (foreignOwner(id))
+    return;
+
+  ImageState proto {image};
+  proto.forEachInterval(range, [&](uint32_t begin, uint32_t end, vk::ImageAspectFlags) {
+    auto &imageState = acquireResource(id, proto, begin, end);
+    imageState.states.update(begin, end, [](uint32_t, uint32_t, std::optional<ImageSubresState> &state) {
+      state->layout = vk::ImageLayout::eUndefined;
+    });
+  });
+}
+
+void CmdBufferTrackingState::requestState(const BufferResource &buffer, BufferState state)
+{
+  requestState(buffer, 0, VK_WHOLE_SIZE, state);
+}
+
+void CmdBufferTrackingState::requestState(const BufferResource &buffer, vk::DeviceSize offset, vk::DeviceSize size, 
+  BufferState state)
+{
+  auto &bufferRanges = find_or_add(requests, buffer);
+  auto end = bufferRanges.rangeEnd(offset, size);
+  bufferRanges.states.update(offset, end, [&](vk::DeviceSize, vk::DeviceSize, std::optional<BufferState> &dstState) {
+    merge_request(dstState, state);
+  });
+}
+
+void CmdBufferTrackingState::takeRequests(CmdBufferTrackingState &other)
+{
+  other.requests.forEachImage([&](ResourceId id, const ImageState &src) {
+    auto *dst = requests.findImage(id);
+    if (!dst)
+      dst = &requests.addImage(id, ImageState{src.resource, src.aspect, src.mipLevels, src.arrayLayers});
+
+    src.states.forEach([&](uint32_t begin, uint32_t end, const std::optional<ImageSubresState> &state) {
+      if (!state.has_value())
+        return;
+      dst->states.update(begin, end, [&](uint32_t, uint32_t, std::optional<ImageSubresState> &dstState) {
+        merge_request(dstState, *state);
+      });
+    });
+  });
+
+  other.requests.forEachBuffer([&](ResourceId id, const BufferRanges &src) {
+    auto *dst = requests.findBuffer(id);
+    if (!dst)
+      dst = &requests.addBuffer(id, BufferRanges{src.resource, src.states.size()});
+
+    src.states.forEach([&](vk::DeviceSize begin, vk::DeviceSize end, const std::optional<BufferState> &state) {
+      if (!state.has_value())
+        return;
+      dst->states.update(begin, end, [&](vk::DeviceSize, vk::DeviceSize, std::optional<BufferState> &dstState) {
+        merge_request(dstState, *state);
+      });
+    });
+  });
+
+  other.requests.clear();
+}
+
+bool CmdBufferTrackingState::conflictsWithRequests(const ImageResource &image, vk::ImageSubresourceRange range, 
+  const ImageSubresState &state) const
+{
+  auto imageState = requests.findImage(image.id);
+  if (!imageState)
+    return false;
+
+  bool conflict = false;
+  imageState->forEachInterval(range, [&](uint32_t begin, uint32_t end, vk::ImageAspectFlags aspect) {
+    auto layout = aspect_layout(aspect, state.layout);
+    imageState->states.forEach(begin, end, [&](uint32_t, uint32_t, const std::optional<ImageSubresState> &requested) {
+      if (!requested.has_value())
+        return;
+      conflict |= requested->layout != layout 
+        || is_write_access(requested->activeAccesses) 
+        || is_write_access(state.activeAccesses);
+    });
+  });
+  return conflict;
+}
+
+bool CmdBufferTrackingState::conflictsWithRequests(const BufferResource &buffer, const BufferState &state) const
+{
+  return conflictsWithRequests(buffer, 0, VK_WHOLE_SIZE, state);
+}
+
+bool CmdBufferTrackingState::conflictsWithRequests(const BufferResource &buffer, vk::DeviceSize offset, vk::DeviceSize size,
+  const BufferState &state) const
+{
+  auto bufferRanges = requests.findBuffer(buffer.id);
+  if (!bufferRanges)
+    return false;
+
+  bool conflict = false;
+  bufferRanges->states.forEach(offset, bufferRanges->rangeEnd(offset, size), 
+    [&](vk::DeviceSize, vk::DeviceSize, const std::optional<BufferState> &requested) {
+      if (requested.has_value())
+        conflict |= is_write_access(requested->activeAccesses) || is_write_access(state.activeAccesses);
+    });
+  return conflict;
+}
+
+static bool stages_visible(vk::PipelineStageFlags2 visible, vk::PipelineStageFlags2 stages)
+{
+  if (visible & vk::PipelineStageFlagBits2::eAllCommands)
+    return true;
+  return (stages & ~visible) == vk::PipelineStageFlags2{};
+}
+
+static bool accesses_visible(vk::AccessFlags2 visible, vk::AccessFlags2 accesses)
+{
+  if (visible & vk::AccessFlagBits2::eMemoryRead)
+    accesses &= ~READ_ACCESS_MASK;
+  if (visible & vk::AccessFlagBits2::eMemoryWrite)
+    accesses &= ~WRITE_ACCESS_MASK;
+  return (accesses & ~visible) == vk::AccessFlags2{};
+}
+
+struct Dependency
+{
+  vk::PipelineStageFlags2 srcStages {};
+  vk::AccessFlags2 srcAccesses {};
+  vk::PipelineStageFlags2 dstStages {};
+  vk::AccessFlags2 dstAccesses {};
+};
+
+// after a write only the accesses of the barrier destination see it
+template <typename State>
+static void set_written(State &src, const State &dst)
+{
+  src.activeStages = dst.activeStages;
+  src.activeAccesses = dst.activeAccesses;
+  src.visibleStages = dst.activeStages;
+  src.visibleAccesses = dst.activeAccesses;
+  src.event = NO_EVENT;
+}
+
+// execution/memory dependency between current state of resource and the next access, 
+// common for images and buffers. Layout transitions are handled by caller.
+// write -> any     - flush writes, make them visible for the next access only
+// read -> write    - execution dependency, reads of the next access get visibility if they don't have it
+// read -> read     - nothing if the last write is visible for the next access,
+//                    else execution dependency from stages that have seen the write + visibility
+// no accesses      - explicit barrier, everything is made visible for everything
+template <typename State>
+static std::optional<Dependency> gen_dependency(State &src, const State &dst)
 {
   bool isSrcWrite = is_write_access(src.activeAccesses);
-  bool isSrcRead = is_read_access(src.activeAccesses);
   bool isDstWrite = is_write_access(dst.activeAccesses);
   bool isDstRead = is_read_access(dst.activeAccesses);
 
-  if (isSrcWrite) //flush writes
+  if (!isDstWrite && !isDstRead)
   {
-    vk::MemoryBarrier2 nextBarrier {
-      .srcStageMask = src.activeStages,
-      .srcAccessMask = src.activeAccesses & WRITE_ACCESS_MASK
-    };
-
-    if (isDstWrite)
+    std::optional<Dependency> dep {};
+    if (src.activeStages)
     {
-      nextBarrier.dstStageMask = dst.activeStages;
-      nextBarrier.dstAccessMask = dst.activeAccesses;
+      dep = Dependency {
+        .srcStages = src.activeStages,
+        .srcAccesses = src.activeAccesses & WRITE_ACCESS_MASK,
+        .dstStages = ALL_STAGES,
+        .dstAccesses = ALL_ACCESSES
+      };
     }
-    else if (isDstRead)
+    reset_accesses(src);
+    return dep;
+  }
+
+  if (isSrcWrite)
+  {
+    Dependency dep {
+      .srcStages = src.activeStages,
+      .srcAccesses = src.activeAccesses & WRITE_ACCESS_MASK,
+      .dstStages = dst.activeStages,
+      .dstAccesses = dst.activeAccesses
+    };
+    set_written(src, dst);
+    return dep;
+  }
+
+  bool visible = stages_visible(src.visibleStages, dst.activeStages) 
+    && accesses_visible(src.visibleAccesses, dst.activeAccesses);
+
+  if (isDstWrite)
+  {
+    std::optional<Dependency> dep {};
+    // stages that have seen the last write are in activeStages, so the dependency is chained
+    if (src.activeStages)
     {
-      nextBarrier.dstStageMask = vk::PipelineStageFlagBits2::eAllCommands;
-      nextBarrier.dstAccessMask = vk::AccessFlagBits2::eMemoryRead|vk::AccessFlagBits2::eMemoryWrite;
+      dep = Dependency {
+        .srcStages = src.activeStages,
+        .srcAccesses = vk::AccessFlags2{}, // nothing to make available
+        .dstStages = dst.activeStages,
+        .dstAccesses = visible? vk::AccessFlags2{} : dst.activeAccesses
+      };
     }
-    src = dst;
-    merge(barrier, nextBarrier);
-    return; 
+    set_written(src, dst);
+    return dep;
   }
-  
-  if (isSrcRead && isDstWrite)
+
+  // read -> read
+  src.activeStages |= dst.activeStages;
+  src.activeAccesses |= dst.activeAccesses;
+  if (visible)
+    return {};
+
+  Dependency dep {
+    .srcStages = src.visibleStages,
+    .srcAccesses = vk::AccessFlags2{},
+    .dstStages = dst.activeStages,
+    .dstAccesses = dst.activeAccesses
+  };
+  src.visibleStages |= dst.activeStages;
+  src.visibleAccesses |= dst.activeAccesses;
+  return dep;
+}
+
+// layout change is a write, it waits for all active accesses and is visible for the next access only.
+// Without next accesses it is visible for everything. Ownership acquire is handled the same way
+static vk::ImageMemoryBarrier2 transition_barrier(vk::Image img,
+  ImageState::SubresourceState &src,
+  const ImageState::SubresourceState &dst)
+{
+  bool hasDstAccess = dst.activeStages && dst.activeAccesses;
+  vk::ImageMemoryBarrier2 barrier {
+    .srcStageMask = src.activeStages? src.activeStages : vk::PipelineStageFlagBits2::eNone,
+    .srcAccessMask = src.activeAccesses & WRITE_ACCESS_MASK,
+    .dstStageMask = hasDstAccess? dst.activeStages : ALL_STAGES,
+    .dstAccessMask = hasDstAccess? dst.activeAccesses : ALL_ACCESSES,
+    .oldLayout = src.layout,
+    .newLayout = dst.layout,
+    .image = img
+  };
+
+  if (hasDstAccess)
+    set_written(src, dst);
+  else
+    reset_accesses(src);
+  src.layout = dst.layout;
+  return barrier;
+}
+
+std::optional<vk::ImageMemoryBarrier2> CmdBufferTrackingState::genBarrier(
+  vk::Image img,
+  ImageState::SubresourceState &src,
+  const ImageState::SubresourceState &dst)
+{
+  if (src.layout == dst.layout)
   {
-    vk::MemoryBarrier2 nextBarrier {
-      .srcStageMask = src.activeStages,
-      .srcAccessMask = vk::AccessFlags2 {},
-      .dstStageMask = dst.activeStages,
-      .dstAccessMask = vk::AccessFlags2 {} //if buffer was in read state, than it was visible for all accesses
+    auto dep = gen_dependency(src, dst);
+    if (!dep.has_value())
+      return {};
+
+    return vk::ImageMemoryBarrier2 {
+      .srcStageMask = dep->srcStages,
+      .srcAccessMask = dep->srcAccesses,
+      .dstStageMask = dep->dstStages,
+      .dstAccessMask = dep->dstAccesses,
+      .oldLayout = src.layout,
+      .newLayout = src.layout,
+      .image = img
     };
-    src = dst;
-    merge(barrier, nextBarrier);
-    return;
   }
-  else if (isSrcRead && isDstRead) //no barriers
+
+  return transition_barrier(img, src, dst);
+}
+
+static void merge(std::optional<vk::MemoryBarrier2> &dst, const vk::MemoryBarrier2 &src)
+{
+  if (dst.has_value())
   {
-    src.activeAccesses |= dst.activeAccesses;
-    src.activeStages |= dst.activeStages;
+    dst->srcStageMask |= src.srcStageMask;
+    dst->srcAccessMask |= src.srcAccessMask;
+    dst->dstStageMask |= src.dstStageMask;
+    dst->dstAccessMask |= src.dstAccessMask;
     return;
   }
+  dst = src;
+}
+
+template <typename State>
+void CmdBufferTrackingState::genBarrier(std::optional<vk::MemoryBarrier2> &barrier,
+    State &src,
+    const State &dst)
+{
+  auto dep = gen_dependency(src, dst);
+  if (!dep.has_value())
+    return;
 
-  ETNA_ASSERTF(src.activeAccesses == vk::AccessFlagBits2::eNone, "Unknown resource access");
-  ETNA_ASSERTF(src.activeStages == vk::PipelineStageFlags2{}, "Unknown pipeline stages");
-  // first use or after manualy placed barrier? 
-  src = dst;
+  merge(barrier, vk::MemoryBarrier2 {
+    .srcStageMask = dep->srcStages,
+    .srcAccessMask = dep->srcAccesses,
+    .dstStageMask = dep->dstStages,
+    .dstAccessMask = dep->dstAccesses
+  });
 }
 
-BufferState &CmdBufferTrackingState::acquireResource(HandleT handle)
+ImageState &CmdBufferTrackingState::findOrImportExpected(ResourceId id, const ImageState &proto)
 {
-  //check resources
-  auto it = resources.find(handle);
-  if (it != resources.end())
-  {
-    auto state = std::get_if<BufferState>(&it->second);
-    ETNA_ASSERT(state);
+  if (auto state = expectedResources.findImage(id))
     return *state;
-  }
-  //check expected states, import
-  it = expectedResources.find(handle);
-  if (it != expectedResources.end())
+
+  // first touch in this command buffer, the only place where queue states are read
+  if (queueState)
   {
-    auto state = std::get_if<BufferState>(&it->second);
-    ETNA_ASSERT(state);
-    it = resources.emplace(handle, *state).first;
-    return std::get<BufferState>(it->second);
+    if (auto state = queueState->getStates().findImage(id))
+      return expectedResources.addImage(id, *state);
+    if (auto owner = queueState->findOwner(id))
+      return expectedResources.addImage(id, *owner->getStates().findImage(id));
   }
 
-  //TODO: request from queue
-  //For now assume that resource is not used
-  expectedResources.emplace(handle, BufferState{});
-  it = resources.emplace(handle, BufferState{}).first;
-  return std::get<BufferState>(it->second);
+  return expectedResources.addImage(id, 
+    ImageState{proto.resource, proto.aspect, proto.mipLevels, proto.arrayLayers});
 }
 
-ImageSubresState &CmdBufferTrackingState::acquireResource(
-  HandleT handle, const ImageState &request_state, uint32_t mip, uint32_t layer)
+BufferRanges &CmdBufferTrackingState::findOrImportExpected(ResourceId id, const BufferRanges &proto)
 {
-  //check resources
-  bool imageInResources = false;
-  bool imageInExpected = false;
-  auto it = resources.find(handle);
-  
-  if (it != resources.end())
+  if (auto state = expectedResources.findBuffer(id))
+    return *state;
+
+  if (queueState)
   {
-    auto imageState = std::get_if<ImageState>(&it->second);
-    ETNA_ASSERT(imageState);
-    auto &subState = imageState->getSubresource(mip, layer);
-    if (subState.has_value())
-    {
-      return *subState;
-    } // else subState is not in expectedStates too
-    imageInResources = true;
+    if (auto state = queueState->getStates().findBuffer(id))
+      return expectedResources.addBuffer(id, *state);
+    if (auto owner = queueState->findOwner(id))
+      return expectedResources.addBuffer(id, *owner->getStates().findBuffer(id));
   }
 
-  it = expectedResources.find(handle);
-  if (it != expectedResources.end())
-  {
-    auto imageState = std::get_if<ImageState>(&it->second);
-    ETNA_ASSERT(imageState);
+  return expectedResources.addBuffer(id, BufferRanges{proto.resource, proto.states.size()});
+}
 
-    if (imageState->getSubresource(mip, layer).has_value())
+// subresources or byte ranges which are not in resources yet are imported from expected states,
+// or are assumed unused (and expected to be so) if expected states don't have them too
+template <typename State, typename Index>
+static void import_expected(RangeMap<std::optional<State>, Index> &states, 
+  RangeMap<std::optional<State>, Index> &expectedStates, Index begin, Index end)
+{
+  for (Index pos = begin; pos < end;)
+  {
+    Index runEnd = std::min(end, states.runEnd(pos));
+    if (!states[pos].has_value())
     {
-      //expectedState contains info, but it is not added to resources yet
-      auto [res, unique] = resources.emplace(handle, ImageState{*imageState});
-      ETNA_ASSERT(unique);
-      auto &subres = std::get<ImageState>(res->second).getSubresource(mip, layer);
-      ETNA_ASSERT(subres.has_value());
-      return *subres;
+      expectedStates.update(pos, runEnd, [&](Index b, Index e, std::optional<State> &expected) {
+        if (!expected.has_value())
+          expected = State{};
+        states.assign(b, e, expected);
+      });
     }
-    imageInExpected = true;
+    pos = runEnd;
   }
-  
-  //1) expectedResources and resources both not contain handle
-  //2) expectedResources and resources both contain handle, but both do not contain subresource 
-  ETNA_ASSERT(imageInExpected == imageInResources);
-  ImageState *imageExpected = nullptr;
-  ImageState *imageResources = nullptr;
+}
 
-  if (!imageInExpected && !imageInResources)
+ImageState &CmdBufferTrackingState::acquireResource(
+  ResourceId id, const ImageState &request_state, uint32_t begin, uint32_t end)
+{
+  ImageState *imageResources = resources.findImage(id);
+  ImageState *imageExpected = &findOrImportExpected(id, request_state);
+
+  if (!imageResources)
   {
-    auto it = expectedResources.emplace(handle, ImageState{
+    imageResources = &resources.addImage(id, ImageState {
       request_state.resource, 
       request_state.aspect,
       request_state.mipLevels,
-      request_state.arrayLayers}
-    ).first;
+      request_state.arrayLayers});
+  }
 
-    imageExpected = std::get_if<ImageState>(&it->second);
+  import_expected(imageResources->states, imageExpected->states, begin, end);
+  return *imageResources;
+}
 
-    it = resources.emplace(handle, ImageState{
-      request_state.resource, 
-      request_state.aspect,
-      request_state.mipLevels,
-      request_state.arrayLayers}
-    ).first;
+BufferRanges &CmdBufferTrackingState::acquireResource(
+  ResourceId id, const BufferRanges &request_state, vk::DeviceSize begin, vk::DeviceSize end)
+{
+  BufferRanges *bufferResources = resources.findBuffer(id);
+  BufferRanges *bufferExpected = &findOrImportExpected(id, request_state);
 
-    imageResources = std::get_if<ImageState>(&it->second);
-  }
-  else
-  {
-    imageExpected = std::get_if<ImageState>(&expectedResources.at(handle));
-    imageResources = std::get_if<ImageState>(&resources.at(handle));
-  }
+  if (!bufferResources)
+    bufferResources = &resources.addBuffer(id, BufferRanges{request_state.resource, request_state.states.size()});
 
-  ETNA_ASSERT(imageExpected && imageResources);
+  import_expected(bufferResources->states, bufferExpected->states, begin, end);
+  return *bufferResources;
+}
 
-  imageExpected->getSubresource(mip, layer) = ImageSubresState{};
-  auto &dstSubres = imageResources->getSubresource(mip, layer);
-  dstSubres = ImageSubresState{};
-  return *dstSubres;
+// the event was set after the last write with dependency for all commands,
+// so after the wait nothing is in flight and everything is visible
+template <typename State>
+void CmdBufferTrackingState::waitEvent(CmdBarrier &barrier, State &src) const
+{
+  const auto &splitBarrier = events[src.event];
+  auto it = std::find_if(barrier.waitEvents.begin(), barrier.waitEvents.end(), 
+    [&](const SplitBarrier &b) { return b.event == splitBarrier.event; });
+  if (it == barrier.waitEvents.end())
+    barrier.waitEvents.push_back(splitBarrier);
+  reset_accesses(src);
+}
+
+QueueTrackingState *CmdBufferTrackingState::foreignOwner(ResourceId id) const
+{
+  if (!queueState || resources.findImage(id) || resources.findBuffer(id))
+    return nullptr;
+  if (expectedResources.findImage(id) || expectedResources.findBuffer(id))
+    return nullptr;
+  if (queueState->getStates().findImage(id) || queueState->getStates().findBuffer(id))
+    return nullptr;
+  return queueState->findOwner(id);
+}
+
+OwnershipRelease &CmdBufferTrackingState::releaseFor(QueueTrackingState *owner, ResourceId id)
+{
+  auto it = std::find_if(ownershipReleases.begin(), ownershipReleases.end(), 
+    [&](const OwnershipRelease &release) { return release.queue == owner; });
+  if (it == ownershipReleases.end())
+    it = ownershipReleases.insert(it, OwnershipRelease{.queue = owner});
+  if (it->resources.empty() || it->resources.back() != id)
+    it->resources.push_back(id);
+  return *it;
+}
+
+// the release waits for everything previously submitted to the owner queue,
+// its execution dependency with the acquire is the semaphore
+template <typename Barrier>
+static Barrier release_barrier(Barrier acquire)
+{
+  acquire.srcStageMask = ALL_STAGES;
+  acquire.srcAccessMask = vk::AccessFlagBits2::eMemoryWrite;
+  acquire.dstStageMask = vk::PipelineStageFlagBits2::eNone;
+  acquire.dstAccessMask = vk::AccessFlags2{};
+  return acquire;
+}
+
+void CmdBufferTrackingState::acquireOwnership(CmdBarrier &barrier, QueueTrackingState *owner, ResourceId id,
+  const ImageState &image, uint32_t begin, uint32_t end, 
+  ImageState::SubresourceState &src, const ImageState::SubresourceState *dst)
+{
+  // accesses of the owner queue are synchronized by the semaphore
+  reset_accesses(src);
+  auto imgBarrier = transition_barrier(image.resource, src, 
+    dst? *dst : ImageState::SubresourceState{.layout = src.layout});
+  imgBarrier.srcQueueFamilyIndex = owner->getFamilyIndex();
+  imgBarrier.dstQueueFamilyIndex = queueState->getFamilyIndex();
+
+  auto &release = releaseFor(owner, id);
+  image.forEachRange(begin, end, [&](const vk::ImageSubresourceRange &range) {
+    imgBarrier.subresourceRange = range;
+    barrier.imageBarriers.push_back(imgBarrier);
+    release.imageBarriers.push_back(release_barrier(imgBarrier));
+  });
+}
+
+void CmdBufferTrackingState::acquireOwnership(CmdBarrier &barrier, QueueTrackingState *owner, ResourceId id,
+  const BufferRanges &buffer, vk::DeviceSize begin, vk::DeviceSize end, 
+  BufferState &src, const BufferState *dst)
+{
+  // like a layout change, acquire is visible for the requested access only
+  reset_accesses(src);
+  bool hasDstAccess = dst && dst->activeStages && dst->activeAccesses;
+  vk::BufferMemoryBarrier2 bufBarrier {
+    .srcStageMask = vk::PipelineStageFlagBits2::eNone,
+    .dstStageMask = hasDstAccess? dst->activeStages : ALL_STAGES,
+    .dstAccessMask = hasDstAccess? dst->activeAccesses : ALL_ACCESSES,
+    .srcQueueFamilyIndex = owner->getFamilyIndex(),
+    .dstQueueFamilyIndex = queueState->getFamilyIndex(),
+    .buffer = buffer.resource,
+    .offset = begin,
+    .size = end - begin
+  };
+  if (hasDstAccess)
+    set_written(src, *dst);
+
+  barrier.bufferBarriers.push_back(bufBarrier);
+  releaseFor(owner, id).bufferBarriers.push_back(release_barrier(bufBarrier));
+}
+
+template <typename T>
+static void hash_combine(std::size_t &seed, const T &value)
+{
+  seed ^= std::hash<T>{}(value) + 0x9e3779b9 + (seed << 6) + (seed >> 2);
+}
+
+template <typename State>
+static void hash_state(std::size_t &seed, const State &state)
+{
+  hash_combine(seed, static_cast<uint64_t>(state.activeStages));
+  hash_combine(seed, static_cast<uint64_t>(state.activeAccesses));
+  hash_combine(seed, static_cast<uint64_t>(state.visibleStages));
+  hash_combine(seed, static_cast<uint64_t>(state.visibleAccesses));
+  if constexpr (std::is_same_v<State, ImageSubresState>)
+    hash_combine(seed, static_cast<uint32_t>(state.layout));
+}
+
+template <typename Entry>
+static void hash_entry(std::size_t &seed, const Entry &entry)
+{
+  hash_combine(seed, entry.id);
+  hash_combine(seed, entry.begin);
+  hash_combine(seed, entry.end);
+  hash_state(seed, entry.src);
+  hash_state(seed, entry.dst);
+}
+
+bool CmdBufferTrackingState::collectPlan(BarrierPlan &plan)
+{
+  plan.hash = 0;
+  plan.images.clear();
+  plan.buffers.clear();
+
+  bool cacheable = true;
+  requests.forEachImage([&](ResourceId id, const ImageState &imageState) {
+    cacheable &= !foreignOwner(id);
+    if (!cacheable)
+      return;
+    imageState.states.forEach([&](uint32_t begin, uint32_t end, const std::optional<ImageSubresState> &dst) {
+      if (!dst.has_value())
+        return;
+      auto &srcImage = acquireResource(id, imageState, begin, end);
+      srcImage.states.forEach(begin, end, [&](uint32_t b, uint32_t e, const std::optional<ImageSubresState> &src) {
+        plan.images.push_back({id, b, e, *src, *dst});
+        hash_entry(plan.hash, plan.images.back());
+      });
+    });
+  });
+
+  requests.forEachBuffer([&](ResourceId id, const BufferRanges &bufferRanges) {
+    cacheable &= !foreignOwner(id);
+    if (!cacheable)
+      return;
+    bufferRanges.states.forEach([&](vk::DeviceSize begin, vk::DeviceSize end, const std::optional<BufferState> &dst) {
+      if (!dst.has_value())
+        return;
+      auto &srcBuffer = acquireResource(id, bufferRanges, begin, end);
+      srcBuffer.states.forEach(begin, end, [&](vk::DeviceSize b, vk::DeviceSize e, const std::optional<BufferState> &src) {
+        plan.buffers.push_back({id, b, e, *src, *dst});
+        hash_entry(plan.hash, plan.buffers.back());
+      });
+    });
+  });
+
+  return cacheable;
 }
 
 void CmdBufferTrackingState::flushBarrier(CmdBarrier &barrier)
 {
-  for (auto &[handle, state] : requests)
+  // events of split barriers differ between recordings
+  if (!barrierCaching || splitBarriers || !barrier.empty())
+  {
+    generateBarrier(barrier);
+    return;
+  }
+
+  uint32_t index = flushIndex++;
+  if (barrierPlans.size() <= index)
+    barrierPlans.resize(index + 1);
+  auto &plan = barrierPlans[index];
+
+  if (!collectPlan(currentPlan))
+  {
+    plan = BarrierPlan{};
+    generateBarrier(barrier);
+    return;
+  }
+
+  if (plan.sameRequests(currentPlan))
   {
-    if (auto imageState = std::get_if<ImageState>(&state))
+    cacheStats.hits++;
+    for (size_t i = 0; i < plan.images.size(); i++)
     {
-      for (uint32_t layer = 0; layer < imageState->arrayLayers; layer++)
-      {
-        for (uint32_t mip = 0; mip < imageState->mipLevels; mip++)
-        {
-          auto &dstSubres = imageState->getSubresource(mip, layer);
-          if (!dstSubres.has_value())
-            continue;
-
-          auto &srcSubres = acquireResource(handle, *imageState, mip, layer);
-          
-          auto imgBarrier = genBarrier(imageState->resource, imageState->aspect, 
-            mip, layer, srcSubres, *dstSubres);
-          
-          if (imgBarrier.has_value())
-            barrier.imageBarriers.push_back(*imgBarrier);
-        }
-      }
+      const auto &entry = plan.images[i];
+      resources.findImage(entry.id)->states.assign(entry.begin, entry.end, plan.imageResults[i]);
     }
-    else if (auto bufferState = std::get_if<BufferState>(&state))
+    for (size_t i = 0; i < plan.buffers.size(); i++)
     {
-      auto &srcState = acquireResource(handle);
-      genBarrier(barrier.memoryBarrier, srcState, *bufferState);
+      const auto &entry = plan.buffers[i];
+      resources.findBuffer(entry.id)->states.assign(entry.begin, entry.end, plan.bufferResults[i]);
     }
+
+    barrier.memoryBarrier = plan.memoryBarrier;
+    barrier.imageBarriers = plan.imageBarriers;
+    barrier.bufferBarriers = plan.bufferBarriers;
+    requests.clear();
+    return;
   }
 
-  requests.clear();
+  cacheStats.misses++;
+  generateBarrier(barrier);
+
+  std::swap(plan, currentPlan);
+  plan.imageResults.clear();
+  plan.bufferResults.clear();
+  for (const auto &entry : plan.images)
+    plan.imageResults.push_back(*resources.findImage(entry.id)->states[entry.begin]);
+  for (const auto &entry : plan.buffers)
+    plan.bufferResults.push_back(*resources.findBuffer(entry.id)->states[entry.begin]);
+
+  plan.memoryBarrier = barrier.memoryBarrier;
+  plan.imageBarriers = barrier.imageBarriers;
+  plan.bufferBarriers = barrier.bufferBarriers;
 }
 
-void CmdBufferTrackingState::removeUnusedResources()
+void CmdBufferTrackingState::generateBarrier(CmdBarrier &barrier)
 {
-  ETNA_ASSERT(requests.size() == 0);
+  lastImageWrites.clear();
+  lastBufferWrites.clear();
 
-  for (auto &[handle, state] : resources)
-  {
-    if (auto imageState = std::get_if<ImageState>(&state))
+  requests.forEachImage([&](ResourceId id, const ImageState &imageState) {
+    // ownership is transferred for the whole image, not requested subresources keep their layouts
+    auto owner = foreignOwner(id);
+    if (owner)
     {
-      auto it = expectedResources.find(handle);
-      ETNA_ASSERT(it != expectedResources.end());
-      auto expectedState = std::get_if<ImageState>(&it->second);
-      ETNA_ASSERT(expectedState);
-
-      for (uint32_t i = 0; i < imageState->states.size(); i++)
-      {
-        if (!imageState->states[i].has_value())
-        {
-          expectedState->states.at(i) = std::nullopt;
-        }
-      }
+      auto &srcImage = acquireResource(id, imageState, 0, imageState.states.size());
+      imageState.states.forEach([&](uint32_t begin, uint32_t end, const std::optional<ImageSubresState> &dstSubres) {
+        if (dstSubres.has_value())
+          return;
+        srcImage.states.update(begin, end, 
+          [&](uint32_t b, uint32_t e, std::optional<ImageSubresState> &srcSubres) {
+            acquireOwnership(barrier, owner, id, imageState, b, e, *srcSubres, nullptr);
+          });
+      });
     }
-    else if (std::holds_alternative<BufferState>(state))
+
+    imageState.states.forEach([&](uint32_t begin, uint32_t end, const std::optional<ImageSubresState> &dstSubres) {
+      if (!dstSubres.has_value())
+        return;
+
+      if (splitBarriers && is_write_access(dstSubres->activeAccesses))
+        lastImageWrites.push_back(WrittenRange{id, begin, end});
+
+      auto &srcImage = acquireResource(id, imageState, begin, end);
+      srcImage.states.update(begin, end, 
+        [&](uint32_t b, uint32_t e, std::optional<ImageSubresState> &srcSubres) {
+          if (owner)
+          {
+            acquireOwnership(barrier, owner, id, imageState, b, e, *srcSubres, &*dstSubres);
+            return;
+          }
+
+          if (srcSubres->event != NO_EVENT && srcSubres->layout == dstSubres->layout)
+            waitEvent(barrier, *srcSubres);
+
+          if (globalImageBarriers && srcSubres->layout == dstSubres->layout)
+          {
+            genBarrier(barrier.memoryBarrier, *srcSubres, *dstSubres);
+            return;
+          }
+
+          auto imgBarrier = genBarrier(imageState.resource, *srcSubres, *dstSubres);
+          if (!imgBarrier.has_value())
+            return;
+
+          // one barrier per uniform range instead of one per subresource
+          imageState.forEachRange(b, e, [&](const vk::ImageSubresourceRange &range) {
+            imgBarrier->subresourceRange = range;
+            barrier.imageBarriers.push_back(*imgBarrier);
+          });
+        });
+    });
+  });
+
+  requests.forEachBuffer([&](ResourceId id, const BufferRanges &bufferRanges) {
+    // ownership is transferred for the whole buffer, like for images
+    auto owner = foreignOwner(id);
+    if (owner)
     {
-      //assert expected resources also
-      auto it = expectedResources.find(handle);
-      ETNA_ASSERT(it != expectedResources.end());
-      ETNA_ASSERT(std::holds_alternative<BufferState>(it->second));
-      expectedResources.erase(it);
+      auto &srcBuffer = acquireResource(id, bufferRanges, 0, bufferRanges.states.size());
+      bufferRanges.states.forEach([&](vk::DeviceSize begin, vk::DeviceSize end, const std::optional<BufferState> &dstState) {
+        if (dstState.has_value())
+          return;
+        srcBuffer.states.update(begin, end, 
+          [&](vk::DeviceSize b, vk::DeviceSize e, std::optional<BufferState> &srcState) {
+            acquireOwnership(barrier, owner, id, bufferRanges, b, e, *srcState, nullptr);
+          });
+      });
     }
-  }
+
+    bufferRanges.states.forEach([&](vk::DeviceSize begin, vk::DeviceSize end, const std::optional<BufferState> &dstState) {
+      if (!dstState.has_value())
+        return;
+
+      if (splitBarriers && is_write_access(dstState->activeAccesses))
+        lastBufferWrites.push_back(WrittenRange<vk::DeviceSize>{id, begin, end});
+
+      // only ranges which overlap the request get dependencies
+      auto &srcBuffer = acquireResource(id, bufferRanges, begin, end);
+      srcBuffer.states.update(begin, end, 
+        [&](vk::DeviceSize b, vk::DeviceSize e, std::optional<BufferState> &srcState) {
+          if (owner)
+          {
+            acquireOwnership(barrier, owner, id, bufferRanges, b, e, *srcState, &*dstState);
+            return;
+          }
+
+          if (srcState->event != NO_EVENT)
+            waitEvent(barrier, *srcState);
+          genBarrier(barrier.memoryBarrier, *srcState, *dstState);
+        });
+    });
+  });
+
+  requests.clear();
 }
 
-void CmdBufferTrackingState::onSync()
+std::optional<vk::MemoryBarrier2> CmdBufferTrackingState::signalWrites(vk::Event event)
 {
-  ETNA_ASSERT(requests.size() == 0);
-  // What's with expectedResources?????
-  for (auto &[_, res] : resources)
+  vk::MemoryBarrier2 dependency {
+    .dstStageMask = ALL_STAGES,
+    .dstAccessMask = ALL_ACCESSES
+  };
+
+  uint32_t eventIndex = static_cast<uint32_t>(events.size());
+  auto tag = [&](auto &state) {
+    if (!is_write_access(state.activeAccesses))
+      return;
+    dependency.srcStageMask |= state.activeStages;
+    dependency.srcAccessMask |= state.activeAccesses & WRITE_ACCESS_MASK;
+    state.event = eventIndex;
+  };
+
+  for (const auto &write : lastImageWrites)
   {
-    if (auto imageState = std::get_if<ImageState>(&res))
+    auto imageState = resources.findImage(write.id);
+    ETNA_ASSERT(imageState);
+    imageState->states.update(write.begin, write.end, 
+      [&](uint32_t, uint32_t, std::optional<ImageSubresState> &state) {
+        if (state.has_value())
+          tag(*state);
+      });
+  }
+
+  for (const auto &write : lastBufferWrites)
+  {
+    auto bufferRanges = resources.findBuffer(write.id);
+    ETNA_ASSERT(bufferRanges);
+    bufferRanges->states.update(write.begin, write.end, 
+      [&](vk::DeviceSize, vk::DeviceSize, std::optional<BufferState> &state) {
+        if (state.has_value())
+          tag(*state);
+      });
+  }
+
+  lastImageWrites.clear();
+  lastBufferWrites.clear();
+
+  if (!dependency.srcStageMask)
+    return {};
+  events.push_back(SplitBarrier{event, dependency});
+  return dependency;
+}
+
+void CmdBufferTrackingState::dropEvents()
+{
+  // writes stay active, next command buffers synchronize them with pipeline barriers
+  resources.forEachImage([](ResourceId, ImageState &imageState) {
+    imageState.states.update([](uint32_t, uint32_t, std::optional<ImageSubresState> &state) {
+      if (state.has_value())
+        state->event = NO_EVENT;
+    });
+  });
+
+  resources.forEachBuffer([](ResourceId, BufferRanges &bufferRanges) {
+    bufferRanges.states.update([](vk::DeviceSize, vk::DeviceSize, std::optional<BufferState> &state) {
+      if (state.has_value())
+        state->event = NO_EVENT;
+    });
+  });
+
+  events.clear();
+  lastImageWrites.clear();
+  lastBufferWrites.clear();
+}
+
+void CmdBufferTrackingState::removeUnusedResources()
+{
+  ETNA_ASSERT(requests.empty());
+
+  // expected states of resources that were not touched are not validated on submit
+  std::vector<ResourceId> unused;
+  auto dropUnused = [&](ResourceId id, auto &expectedState, const auto *usedState) {
+    if (!usedState)
     {
-      for (auto &substate : imageState->states)
-      {
-        if (substate.has_value())
-        {
-          substate->activeAccesses = vk::AccessFlags2{};
-          substate->activeStages = vk::PipelineStageFlags2{};
-        }
-      }
+      unused.push_back(id);
+      return;
     }
-    else if (auto bufferState = std::get_if<BufferState>(&res))
+
+    usedState->states.forEach([&](auto begin, auto end, const auto &state) {
+      if (!state.has_value())
+        expectedState.states.assign(begin, end, std::nullopt);
+    });
+  };
+
+  expectedResources.forEachImage([&](ResourceId id, ImageState &expectedState) {
+    dropUnused(id, expectedState, resources.findImage(id));
+  });
+
+  expectedResources.forEachBuffer([&](ResourceId id, BufferRanges &expectedState) {
+    dropUnused(id, expectedState, resources.findBuffer(id));
+  });
+
+  for (auto id : unused)
+    expectedResources.erase(id);
+}
+
+void CmdBufferTrackingState::onSync()
+{
+  ETNA_ASSERT(requests.empty());
+  // What's with expectedResources?????
+  reset_active_states(resources);
+}
+
+// barriers which differ only in subresource range
+static auto dependency_key(const vk::ImageMemoryBarrier2 &b)
+{
+  return std::tie(b.image, b.oldLayout, b.newLayout,
+    b.srcStageMask, b.srcAccessMask, b.dstStageMask, b.dstAccessMask, 
+    b.srcQueueFamilyIndex, b.dstQueueFamilyIndex);
+}
+
+// merges barriers with equal dependencies into maximal subresource ranges.
+// First adjacent layers of equal mip ranges are merged, then adjacent mips of equal layer ranges,
+// then depth and stencil aspects of equal ranges.
+static void coalesce_image_barriers(std::vector<vk::ImageMemoryBarrier2> &barriers)
+{
+  if (barriers.size() < 2)
+    return;
+
+  auto mergePass = [&](auto rangeKey, auto tryMerge) {
+    std::sort(barriers.begin(), barriers.end(), [&](const auto &a, const auto &b) {
+      auto ka = dependency_key(a);
+      auto kb = dependency_key(b);
+      return ka < kb || (ka == kb && rangeKey(a.subresourceRange) < rangeKey(b.subresourceRange));
+    });
+
+    std::size_t out = 0;
+    for (std::size_t i = 1; i < barriers.size(); i++)
     {
-      *bufferState = BufferState{};
+      auto &dst = barriers[out];
+      // ranges of ownership transfers must match ranges of the release barriers
+      bool ownershipTransfer = dst.srcQueueFamilyIndex != dst.dstQueueFamilyIndex;
+      if (!ownershipTransfer && dependency_key(dst) == dependency_key(barriers[i]) 
+        && tryMerge(dst.subresourceRange, barriers[i].subresourceRange))
+        continue;
+      barriers[++out] = barriers[i];
     }
-  }
+    barriers.resize(out + 1);
+  };
+
+  mergePass(
+    [](const vk::ImageSubresourceRange &r) { 
+      return std::tuple{r.aspectMask, r.baseMipLevel, r.levelCount, r.baseArrayLayer}; 
+    },
+    [](vk::ImageSubresourceRange &dst, const vk::ImageSubresourceRange &src) {
+      if (dst.aspectMask != src.aspectMask 
+        || dst.baseMipLevel != src.baseMipLevel || dst.levelCount != src.levelCount 
+        || dst.baseArrayLayer + dst.layerCount != src.baseArrayLayer)
+        return false;
+      dst.layerCount += src.layerCount;
+      return true;
+    });
+
+  mergePass(
+    [](const vk::ImageSubresourceRange &r) { 
+      return std::tuple{r.aspectMask, r.baseArrayLayer, r.layerCount, r.baseMipLevel}; 
+    },
+    [](vk::ImageSubresourceRange &dst, const vk::ImageSubresourceRange &src) {
+      if (dst.aspectMask != src.aspectMask 
+        || dst.baseArrayLayer != src.baseArrayLayer || dst.layerCount != src.layerCount 
+        || dst.baseMipLevel + dst.levelCount != src.baseMipLevel)
+        return false;
+      dst.levelCount += src.levelCount;
+      return true;
+    });
+
+  mergePass(
+    [](const vk::ImageSubresourceRange &r) { 
+      return std::tuple{r.baseMipLevel, r.levelCount, r.baseArrayLayer, r.layerCount, r.aspectMask}; 
+    },
+    [](vk::ImageSubresourceRange &dst, const vk::ImageSubresourceRange &src) {
+      if (dst.baseMipLevel != src.baseMipLevel || dst.levelCount != src.levelCount 
+        || dst.baseArrayLayer != src.baseArrayLayer || dst.layerCount != src.layerCount
+        || (dst.aspectMask & src.aspectMask))
+        return false;
+      dst.aspectMask |= src.aspectMask;
+      return true;
+    });
 }
 
 void CmdBarrier::flush(vk::CommandBuffer cmd)
 {
-  if (!memoryBarrier.has_value() && !imageBarriers.size())
+  if (!waitEvents.empty())
+  {
+    std::vector<vk::Event> vkEvents;
+    std::vector<vk::DependencyInfo> infos;
+    for (const auto &splitBarrier : waitEvents)
+    {
+      vkEvents.push_back(splitBarrier.event);
+      // must be the same dependency the event was set with
+      infos.push_back(vk::DependencyInfo {
+        .memoryBarrierCount = 1,
+        .pMemoryBarriers = &splitBarrier.dependency
+      });
+    }
+    cmd.waitEvents2(vkEvents, infos);
+    stats.eventWaits += waitEvents.size();
+    waitEvents.clear();
+  }
+
+  if (!memoryBarrier.has_value() && !imageBarriers.size() && !bufferBarriers.size())
     return;
 
+  stats.imageBarriersBeforeMerge += imageBarriers.size();
+  coalesce_image_barriers(imageBarriers);
+  stats.imageBarriersAfterMerge += imageBarriers.size();
+  stats.pipelineBarriers++;
+
   vk::DependencyInfo info {
-    .memoryBarrierCount = memoryBarrier.has_value()? 1 : 0,
-    .pMemoryBarriers = &*memoryBarrier,
-    .imageMemoryBarrierCount = imageBarriers.size(),
+    .memoryBarrierCount = memoryBarrier.has_value()? 1u : 0u,
+    .pMemoryBarriers = memoryBarrier.has_value()? &*memoryBarrier : nullptr,
+    .bufferMemoryBarrierCount = static_cast<uint32_t>(bufferBarriers.size()),
+    .pBufferMemoryBarriers = bufferBarriers.data(),
+    .imageMemoryBarrierCount = static_cast<uint32_t>(imageBarriers.size()),
     .pImageMemoryBarriers = imageBarriers.data()
   };
   
@@ -544,24 +1289,25 @@ void CmdBarrier::flush(vk::CommandBuffer cmd)
 
 void QueueTrackingState::onWait() //clears all activeStages/activeAccesses
 {
-  for (auto &[_, res] : currentStates)
+  reset_active_states(currentStates);
+}
+
+QueueTrackingState *QueueTrackingState::findOwner(ResourceId id) const
+{
+  for (auto peer : peers)
   {
-    if (auto imageState = std::get_if<ImageState>(&res))
-    {
-      for (auto &substate : imageState->states)
-      {
-        if (substate.has_value())
-        {
-          substate->activeAccesses = vk::AccessFlags2{};
-          substate->activeStages = vk::PipelineStageFlags2{};
-        }
-      }
-    }
-    else if (auto bufferState = std::get_if<BufferState>(&res))
-    {
-      *bufferState = BufferState{};
-    }
+    if (peer->currentStates.findImage(id) || peer->currentStates.findBuffer(id))
+      return peer;
   }
+  return nullptr;
+}
+
+// the command buffer relies on the last write being visible for expected.visible* accesses
+template <typename State>
+static bool is_visibility_compatible(const State &state, const State &expected)
+{
+  return stages_visible(state.visibleStages, expected.visibleStages) 
+    && accesses_visible(state.visibleAccesses, expected.visibleAccesses);
 }
 
 static bool is_compatible(const BufferState &state, const BufferState &expected)
@@ -576,7 +1322,7 @@ static bool is_compatible(const BufferState &state, const BufferState &expected)
   if ((state.activeAccesses & expected.activeAccesses) == state.activeAccesses)
     accessesCompatible |= true;
   
-  return stagesCompatible && accessesCompatible;
+  return stagesCompatible && accessesCompatible && is_visibility_compatible(state, expected);
 }
 
 static bool is_compatible(const ImageSubresState &state, const ImageSubresState &expected)
@@ -594,75 +1340,126 @@ static bool is_compatible(const ImageSubresState &state, const ImageSubresState
   if ((state.activeAccesses & expected.activeAccesses) == state.activeAccesses)
     accessesCompatible |= true;
   
-  return stagesCompatible && accessesCompatible;
+  return stagesCompatible && accessesCompatible && is_visibility_compatible(state, expected);
+}
+
+// everything in flight is finished and made visible, layout is changed to the expected one
+static void fixup_barrier(CmdBarrier &barrier, const ImageState &image, uint32_t begin, uint32_t end,
+  const ImageSubresState &current, const ImageSubresState &expected)
+{
+  vk::ImageMemoryBarrier2 imgBarrier {
+    .srcStageMask = current.activeStages? current.activeStages : vk::PipelineStageFlagBits2::eNone,
+    .srcAccessMask = current.activeAccesses & WRITE_ACCESS_MASK,
+    .dstStageMask = ALL_STAGES,
+    .dstAccessMask = ALL_ACCESSES,
+    .oldLayout = current.layout,
+    .newLayout = expected.layout == vk::ImageLayout::eUndefined? current.layout : expected.layout,
+    .image = image.resource
+  };
+  image.forEachRange(begin, end, [&](const vk::ImageSubresourceRange &range) {
+    imgBarrier.subresourceRange = range;
+    barrier.imageBarriers.push_back(imgBarrier);
+  });
+}
+
+static void fixup_barrier(CmdBarrier &barrier, const BufferRanges &, vk::DeviceSize, vk::DeviceSize,
+  const BufferState &current, const BufferState &)
+{
+  merge(barrier.memoryBarrier, vk::MemoryBarrier2 {
+    .srcStageMask = current.activeStages,
+    .srcAccessMask = current.activeAccesses & WRITE_ACCESS_MASK,
+    .dstStageMask = ALL_STAGES,
+    .dstAccessMask = ALL_ACCESSES
+  });
 }
 
-void QueueTrackingState::onSubmit(CmdBufferTrackingState &state)
+void QueueTrackingState::onSubmit(CmdBufferTrackingState &state, CmdBarrier *prologue)
 {
   state.removeUnusedResources();
   const auto &expectedStates = state.getExpectedStates();
-  
-  for (auto &[handle, state] : expectedStates)
-  {
-    auto it = currentStates.find(handle);
-    if (it == currentStates.end()) //resource was not used yet
-      continue;
+  const auto &releases = state.getOwnershipReleases();
 
-    const auto &currentState = it->second;
-
-    if (auto imageState = std::get_if<ImageState>(&state))
-    {
-      auto srcState = std::get_if<ImageState>(&currentState);
-      ETNA_ASSERT(srcState);
-      for (uint32_t i = 0; i < imageState->states.size(); i++)
-      {
-        if (srcState->states[i].has_value() && imageState->states[i].has_value())
-        {
-          ETNA_ASSERTF(is_compatible(*srcState->states[i], *imageState->states[i]), \
-            "Expected resource state is incompatible with actual resource state");
-        }
-      }
-    }
-    else if (auto bufferState = std::get_if<BufferState>(&state))
+  // transferred resources were imported from the previous owner and are validated against it
+  auto sourceStates = [&](ResourceId id) -> ResContainer & {
+    for (const auto &release : releases)
     {
-      auto srcState = std::get_if<BufferState>(&currentState);
-      ETNA_ASSERT(srcState);
-      ETNA_ASSERTF(is_compatible(*srcState, *bufferState), \
-        "Expected resource state is incompatible with actual resource state");
+      if (std::find(release.resources.begin(), release.resources.end(), id) != release.resources.end())
+        return release.queue->currentStates;
     }
+    return currentStates;
+  };
+
+  for (const auto &release : releases)
+  {
+    for (auto id : release.resources)
+      ETNA_ASSERTF(release.queue->currentStates.findImage(id) || release.queue->currentStates.findBuffer(id), \
+        "Resource ownership was transferred to another queue before submit");
+  }
+  
+  // layouts of transferred resources are fixed by release/acquire barriers, they can't be fixed up
+  auto validate = [&](const auto &expectedState, const auto *srcState, bool can_fixup) {
+    if (!srcState) //resource was not used yet
+      return;
+
+    expectedState.states.forEach([&](auto begin, auto end, const auto &expected) {
+      if (!expected.has_value())
+        return;
+      srcState->states.forEach(begin, end, [&](auto b, auto e, const auto &current) {
+        if (!current.has_value() || is_compatible(*current, *expected))
+          return;
+        ETNA_ASSERTF(prologue && can_fixup, \
+          "Expected resource state is incompatible with actual resource state");
+        fixup_barrier(*prologue, expectedState, b, e, *current, *expected);
+      });
+    });
+  };
+
+  expectedStates.forEachImage([&](ResourceId id, const ImageState &imageState) {
+    auto &src = sourceStates(id);
+    validate(imageState, src.findImage(id), &src == &currentStates);
+  });
+
+  expectedStates.forEachBuffer([&](ResourceId id, const BufferRanges &bufferRanges) {
+    auto &src = sourceStates(id);
+    validate(bufferRanges, src.findBuffer(id), &src == &currentStates);
+  });
+
+  // the previous owner forgets transferred resources
+  for (const auto &release : releases)
+  {
+    for (auto id : release.resources)
+      release.queue->currentStates.erase(id);
   }
 
   //update current states
 
+  // a resource can't be transferred to another queue while a command buffer which uses it is recorded
+  auto checkOwner = [&](ResourceId id) {
+    ETNA_ASSERTF(!findOwner(id), "Resource is owned by another queue, it was transferred after recording");
+  };
+
   const auto &resources = state.getStates();
-  for (auto &[handle, state] : resources)
-  {
-    auto it = currentStates.find(handle);
-    if (it == currentStates.end())
-    {
-      currentStates.emplace(handle, state);
-      continue;
-    }
-    
-    if (auto imageState = std::get_if<ImageState>(&state))
+  resources.forEachImage([&](ResourceId id, const ImageState &imageState) {
+    checkOwner(id);
+    auto dstState = currentStates.findImage(id);
+    if (!dstState)
     {
-      auto dstState = std::get_if<ImageState>(&it->second);
-      ETNA_ASSERT(dstState);
-
-      for (uint32_t i = 0; i < imageState->states.size(); i++)
-      {
-        if (imageState->states[i].has_value())
-          dstState->states[i] = imageState->states[i];
-      }
+      currentStates.addImage(id, imageState);
+      return;
     }
-    else 
+    overlay(*dstState, imageState);
+  });
+
+  resources.forEachBuffer([&](ResourceId id, const BufferRanges &bufferRanges) {
+    checkOwner(id);
+    auto dstState = currentStates.findBuffer(id);
+    if (!dstState)
     {
-      //buffers
-      ETNA_ASSERT(it->second.index() == state.index());
-      it->second = state;
+      currentStates.addBuffer(id, bufferRanges);
+      return;
     }
-    //it->second = state;
-  }
+    overlay(*dstState, bufferRanges);
+  });
 
   state.clearAll();
 }
@@ -186,6 +186,8 @@ namespace etna
   {
     progLayout = {};
     usedDescriptors = {};
+    bindingStages = {};
+    bindingStorageAccess = {};
     pushConst = vk::PushConstantRange {};
 
     std::array<std::optional<DescriptorSetInfo>, MAX_PROGRAM_DESCRIPTORS> dstDescriptors;
@@ -215,6 +217,20 @@ namespace etna
         if (desc.first >= MAX_PROGRAM_DESCRIPTORS)
           ETNA_PANIC("ShaderProgram {} : set {} out of max sets ({})", name, desc.first, MAX_PROGRAM_DESCRIPTORS);
 
+        auto &setStages = bindingStages[desc.first];
+        auto &setAccess = bindingStorageAccess[desc.first];
+        for (uint32_t binding = 0; binding < MAX_DESCRIPTOR_BINDINGS; binding++)
+        {
+          if (!desc.second.isBindingUsed(binding))
+            continue;
+          setStages[binding] |= shaderMod.getStage();
+          // a binding is read-only for the program only if every shader declares it so
+          if (!desc.second.isNonReadable(binding))
+            setAccess[binding] |= vk::AccessFlagBits2::eShaderStorageRead;
+          if (!desc.second.isNonWritable(binding))
+            setAccess[binding] |= vk::AccessFlagBits2::eShaderStorageWrite;
+        }
+
         //usedDescriptors.set(desc.first);
         if (dstDescriptors[desc.first].has_value())
           dstDescriptors[desc.first]->merge(desc.second);
@@ -335,4 +351,16 @@ namespace etna
     return get_context().getDescriptorSetLayouts().getLayoutInfo(getDescriptorLayoutId(set));
   }
 
+  std::span<const vk::ShaderStageFlags> ShaderProgramInfo::getBindingStages(uint32_t set) const
+  {
+    ETNA_ASSERT(isDescriptorSetUsed(set));
+    return mgr.getProgInternal(id).bindingStages.at(set);
+  }
+
+  std::span<const vk::AccessFlags2> ShaderProgramInfo::getBindingStorageAccess(uint32_t set) const
+  {
+    ETNA_ASSERT(isDescriptorSetUsed(set));
+    return mgr.getProgInternal(id).bindingStorageAccess.at(set);
+  }
+
 }
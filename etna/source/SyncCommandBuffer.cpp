@@ -7,11 +7,12 @@ namespace etna
 {
 
 
-CommandBufferPool::CommandBufferPool()
+CommandBufferPool::CommandBufferPool(QueueType queue_type)
+  : queueType {queue_type}
 {
   auto device = etna::get_context().getDevice();
   vk::CommandPoolCreateInfo info {
-    .queueFamilyIndex = etna::get_context().getQueueFamilyIdx()
+    .queueFamilyIndex = etna::get_context().getQueueFamilyIdx(queueType)
   };
   
   info.flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer;
@@ -50,13 +51,55 @@ vk::UniqueCommandBuffer CommandBufferPool::allocateSecondary()
   return cmd;
 }
 
+SecondaryCommandBufferPool::SecondaryCommandBufferPool(QueueType queue_type)
+{
+  vk::CommandPoolCreateInfo info {
+    .flags = vk::CommandPoolCreateFlagBits::eTransient,
+    .queueFamilyIndex = etna::get_context().getQueueFamilyIdx(queue_type)
+  };
+  pool = etna::get_context().getDevice().createCommandPoolUnique(info).value;
+}
+
+vk::CommandBuffer SecondaryCommandBufferPool::acquire()
+{
+  if (used == buffers.size())
+  {
+    // grow geometrically, so a frame with many render passes allocates only a few times
+    uint32_t count = std::max(4u, static_cast<uint32_t>(buffers.size()));
+    vk::CommandBufferAllocateInfo info {
+      .commandPool = pool.get(),
+      .level = vk::CommandBufferLevel::eSecondary,
+      .commandBufferCount = count
+    };
+    auto allocated = etna::get_context().getDevice().allocateCommandBuffers(info).value;
+    buffers.insert(buffers.end(), allocated.begin(), allocated.end());
+    stats.allocated = static_cast<uint32_t>(buffers.size());
+    stats.allocations++;
+  }
+
+  used++;
+  stats.highWaterMark = std::max(stats.highWaterMark, used);
+  return buffers[used - 1];
+}
+
+void SecondaryCommandBufferPool::reset()
+{
+  if (used == 0)
+    return;
+  // buffers stay allocated, they are freed with the pool
+  auto res = etna::get_context().getDevice().resetCommandPool(pool.get());
+  ETNA_ASSERT(res == vk::Result::eSuccess);
+  used = 0;
+  stats.resets++;
+}
+
 SyncCommandBuffer CommandBufferPool::allocate()
 {
   return {*this};
 }
 
 SyncCommandBuffer::SyncCommandBuffer(CommandBufferPool &pool_)
-  : pool{pool_}, cmd {pool.allocatePrimary()}
+  : pool{pool_}, cmd {pool.allocatePrimary()}, secondaryCmds {pool.getQueueType()}
 {}
 
 void SyncCommandBuffer::expectState(const Buffer &buffer, BufferState state)
@@ -73,13 +116,8 @@ void SyncCommandBuffer::expectState(const Image &image, uint32_t mip, uint32_t l
 void SyncCommandBuffer::expectState(const Image &image, vk::ImageSubresourceRange range, 
   ImageSubresState state)
 {
-  for (uint32_t mip = range.baseMipLevel; mip < range.baseMipLevel + range.levelCount; mip++)
-  {
-    for (uint32_t layer = range.baseArrayLayer; layer < range.layerCount + range.baseArrayLayer; layer++)
-    {
-      trackingState.expectState(image, mip, layer, state);
-    }
-  }
+  ETNA_ASSERT(currentState == State::Recording || currentState == State::Rendering);
+  trackingState.expectState(image, range, state);
 }
 
 void SyncCommandBuffer::expectState(const Image &image, ImageSubresState state)
@@ -93,7 +131,24 @@ void SyncCommandBuffer::expectState(const Image &image, ImageSubresState state)
 vk::Result SyncCommandBuffer::reset()
 {
   currentState = State::Initial; 
-  usedRenderCmd.clear();
+  unsynchronized = false;
+  renderCmd.reset();
+  renderCommands.clear();
+  usedParallelContexts = 0;
+  batchedCommands.clear();
+  // the fence has signaled, so secondaries recorded for the previous submit are free
+  secondaryCmds.reset();
+  for (auto &context : parallelContexts)
+    context->pool.reset();
+
+  auto device = etna::get_context().getDevice();
+  for (uint32_t i = 0; i < usedEvents; i++)
+  {
+    auto res = device.resetEvent(events[i].get());
+    ETNA_ASSERT(res == vk::Result::eSuccess);
+  }
+  usedEvents = 0;
+
   return cmd->reset();
 }
 
@@ -101,48 +156,182 @@ vk::Result SyncCommandBuffer::begin()
 {
   ETNA_ASSERT(currentState == State::Initial);
   currentState = State::Recording;
-  etna::get_context().getQueueTrackingState() //maybe not the best place. Add bufferState
-    .setExpectedStates(trackingState);
+  boundPrograms.fill(INVALID_SHADER_PROGRAM_ID);
+  for (auto &sets : boundSets)
+    sets.fill(std::nullopt);
+  resetBoundState();
+  // states are pulled from the queue lazily, on the first use of each resource
+  trackingState.setQueueState(&etna::get_context().getQueueTrackingState(pool.getQueueType()));
+  trackingState.setLayoutPolicy(etna::get_context().getLayoutPolicy());
   return cmd->begin(vk::CommandBufferBeginInfo{});
 }
 
 vk::Result SyncCommandBuffer::end()
 {
-  ETNA_ASSERT(currentState == State::Recording);
+  ETNA_ASSERT(currentState == State::Recording && !unsynchronized);
   currentState = State::Executable;
+  trackingState.dropEvents();
   return cmd->end();
 }
 
+void SyncCommandBuffer::signalWrites()
+{
+  if (!trackingState.splitBarriersEnabled() || !trackingState.hasSignalableWrites())
+    return;
+
+  if (usedEvents == events.size())
+  {
+    auto device = etna::get_context().getDevice();
+    events.push_back(device.createEventUnique(vk::EventCreateInfo{}).value);
+  }
+
+  vk::Event event = events[usedEvents].get();
+  auto dependency = trackingState.signalWrites(event);
+  if (!dependency.has_value())
+    return;
+
+  usedEvents++;
+  cmd->setEvent2(event, vk::DependencyInfo {
+    .memoryBarrierCount = 1,
+    .pMemoryBarriers = &dependency.value()
+  });
+}
+
+void SyncCommandBuffer::beginBatch()
+{
+  ETNA_ASSERT(currentState == State::Recording);
+  currentState = State::Batching;
+}
+
+void SyncCommandBuffer::endBatch()
+{
+  ETNA_ASSERT(currentState == State::Batching);
+  flushBatch();
+  currentState = State::Recording;
+}
+
+void SyncCommandBuffer::beginUnsynchronized(const StateRequests &declared)
+{
+  ETNA_ASSERT(currentState == State::Recording || currentState == State::Rendering);
+  ETNA_ASSERT(!unsynchronized);
+
+  for (const auto &[buffer, offset, size, state] : declared.buffers)
+    trackingState.requestState(*buffer, offset, size, state);
+  for (const auto &[image, range, state] : declared.images)
+    trackingState.requestState(*image, range, state);
+
+  // in a render pass requests are flushed before it by endRendering
+  if (currentState == State::Recording)
+    flushBarrier();
+  unsynchronized = true;
+}
+
+void SyncCommandBuffer::endUnsynchronized()
+{
+  ETNA_ASSERT(currentState == State::Recording || currentState == State::Rendering);
+  ETNA_ASSERT(unsynchronized);
+  unsynchronized = false;
+  // declared writes are done by now
+  if (currentState == State::Recording)
+    signalWrites();
+}
+
+void SyncCommandBuffer::requestTransferStates()
+{
+  if (unsynchronized)
+  {
+    transferRequests.clear();
+    return;
+  }
+
+  if (currentState == State::Batching)
+  {
+    bool conflict = false;
+    for (const auto &[buffer, offset, size, state] : transferRequests.buffers)
+      conflict |= trackingState.conflictsWithRequests(*buffer, offset, size, state);
+    for (const auto &[image, range, state] : transferRequests.images)
+      conflict |= trackingState.conflictsWithRequests(*image, range, state);
+    
+    if (conflict)
+      flushBatch();
+  }
+
+  for (const auto &[buffer, offset, size, state] : transferRequests.buffers)
+    trackingState.requestState(*buffer, offset, size, state);
+  for (const auto &[image, range, state] : transferRequests.images)
+    trackingState.requestState(*image, range, state);
+  transferRequests.clear();
+}
+
+void SyncCommandBuffer::recordTransfer(std::function<void(vk::CommandBuffer)> &&record)
+{
+  if (currentState == State::Batching)
+  {
+    batchedCommands.push_back(std::move(record));
+    return;
+  }
+
+  if (unsynchronized)
+  {
+    record(*cmd);
+    return;
+  }
+
+  flushBarrier();
+  record(*cmd);
+  signalWrites();
+}
+
+void SyncCommandBuffer::flushBatch()
+{
+  if (batchedCommands.empty())
+    return;
+
+  flushBarrier();
+  for (auto &record : batchedCommands)
+    record(*cmd);
+  batchedCommands.clear();
+  signalWrites();
+}
+
 void SyncCommandBuffer::copyBuffer(const Buffer &src, const Buffer &dst,
   const vk::ArrayProxy<vk::BufferCopy> &regions)
 {
-  ETNA_ASSERT(currentState == State::Recording);
+  ETNA_ASSERT(currentState == State::Recording || currentState == State::Batching);
   
-  trackingState.requestState(src, BufferState {
-    vk::PipelineStageFlagBits2::eTransfer,
-    vk::AccessFlagBits2::eTransferRead
-  }); 
+  for (const auto &region : regions)
+  {
+    transferRequests.buffers.emplace_back(&src, region.srcOffset, region.size, BufferState {
+      vk::PipelineStageFlagBits2::eTransfer,
+      vk::AccessFlagBits2::eTransferRead
+    }); 
 
-  trackingState.requestState(dst, BufferState {
-    vk::PipelineStageFlagBits2::eTransfer,
-    vk::AccessFlagBits2::eTransferWrite
-  }); 
+    transferRequests.buffers.emplace_back(&dst, region.dstOffset, region.size, BufferState {
+      vk::PipelineStageFlagBits2::eTransfer,
+      vk::AccessFlagBits2::eTransferWrite
+    }); 
+  }
 
-  flushBarrier();
-  cmd->copyBuffer(src.get(), dst.get(), regions);
+  requestTransferStates();
+  recordTransfer([srcBuffer = src.get(), dstBuffer = dst.get(), 
+    copyRegions = std::vector(regions.begin(), regions.end())](vk::CommandBuffer cmd) {
+      cmd.copyBuffer(srcBuffer, dstBuffer, copyRegions);
+    });
 }
 
 void SyncCommandBuffer::fillBuffer(const Buffer &dst, vk::DeviceSize offset, vk::DeviceSize size, uint32_t data)
 {
-  ETNA_ASSERT(currentState == State::Recording);
+  ETNA_ASSERT(currentState == State::Recording || currentState == State::Batching);
 
-  trackingState.requestState(dst, BufferState {
+  transferRequests.buffers.emplace_back(&dst, offset, size, BufferState {
     vk::PipelineStageFlagBits2::eTransfer,
     vk::AccessFlagBits2::eTransferWrite
   }); 
 
-  flushBarrier();
-  cmd->fillBuffer(dst.get(), offset, size, data);
+  requestTransferStates();
+  recordTransfer([dstBuffer = dst.get(), offset, size, data](vk::CommandBuffer cmd) {
+    cmd.fillBuffer(dstBuffer, offset, size, data);
+  });
 }
 
 void SyncCommandBuffer::blitImage(const Image &src,
@@ -151,67 +340,84 @@ void SyncCommandBuffer::blitImage(const Image &src,
   const vk::ArrayProxy<vk::ImageBlit> regions,
   vk::Filter filter)
 {
-  ETNA_ASSERT(currentState == State::Recording);
+  ETNA_ASSERT(currentState == State::Recording || currentState == State::Batching);
+  srcLayout = trackingState.mapLayout(srcLayout);
+  dstLayout = trackingState.mapLayout(dstLayout);
 
   for (const auto &region : regions)
   {
     vk::ImageSubresourceRange srcRange {
+      .aspectMask = region.srcSubresource.aspectMask,
       .baseMipLevel = region.srcSubresource.mipLevel,
       .levelCount = 1,
       .baseArrayLayer = region.srcSubresource.baseArrayLayer,
       .layerCount = region.srcSubresource.layerCount
     };
 
-    trackingState.requestState(src, srcRange, ImageSubresState {
+    transferRequests.images.emplace_back(&src, srcRange, ImageSubresState {
       vk::PipelineStageFlagBits2::eTransfer,
       vk::AccessFlagBits2::eTransferRead,
       srcLayout
     });
 
     vk::ImageSubresourceRange dstRange {
+      .aspectMask = region.dstSubresource.aspectMask,
       .baseMipLevel = region.dstSubresource.mipLevel,
       .levelCount = 1,
       .baseArrayLayer = region.dstSubresource.baseArrayLayer,
       .layerCount = region.dstSubresource.layerCount
     };
 
-    trackingState.requestState(dst, dstRange, ImageSubresState {
+    transferRequests.images.emplace_back(&dst, dstRange, ImageSubresState {
       vk::PipelineStageFlagBits2::eTransfer,
       vk::AccessFlagBits2::eTransferWrite,
       dstLayout
     });
   }
 
-  flushBarrier();
-  cmd->blitImage(src.get(), srcLayout, dst.get(), dstLayout, regions, filter);
+  requestTransferStates();
+  recordTransfer([srcImage = src.get(), srcLayout, dstImage = dst.get(), dstLayout, 
+    blitRegions = std::vector(regions.begin(), regions.end()), filter](vk::CommandBuffer cmd) {
+      cmd.blitImage(srcImage, srcLayout, dstImage, dstLayout, blitRegions, filter);
+    });
 }
 
 void SyncCommandBuffer::clearColorImage(const Image &image, vk::ImageLayout layout, 
   vk::ClearColorValue clear_color, vk::ArrayProxy<vk::ImageSubresourceRange> ranges)
 {
-  ETNA_ASSERT(currentState == State::Recording);
+  ETNA_ASSERT(currentState == State::Recording || currentState == State::Batching);
+  layout = trackingState.mapLayout(layout);
   ImageSubresState state {
     .activeStages = vk::PipelineStageFlagBits2::eTransfer,
     .activeAccesses = vk::AccessFlagBits2::eTransferWrite,
     .layout = layout
   };
 
+  for (auto &range : ranges)
+    transferRequests.images.emplace_back(&image, range, state);
+
+  requestTransferStates();
+  // cleared ranges are overwritten, after requestTransferStates so a conflicting batch is flushed first
   for (auto &range : ranges)
   {
-    trackingState.requestState(image, range.baseMipLevel, range.levelCount, 
-      range.baseArrayLayer, range.layerCount, state);
+    if (!unsynchronized)
+      trackingState.discard(image, range);
   }
 
-  flushBarrier();
-  cmd->clearColorImage(image.get(), layout, clear_color, ranges);
+  recordTransfer([vkImage = image.get(), layout, clear_color, 
+    clearRanges = std::vector(ranges.begin(), ranges.end())](vk::CommandBuffer cmd) {
+      cmd.clearColorImage(vkImage, layout, clear_color, clearRanges);
+    });
 }
 
 
 void SyncCommandBuffer::copyBufferToImage(const Buffer &src, const Image &dst, vk::ImageLayout dstLayout,
   const vk::ArrayProxy<vk::BufferImageCopy> &regions)
 {
-  ETNA_ASSERT(currentState == State::Recording);
-  trackingState.requestState(src, BufferState {
+  ETNA_ASSERT(currentState == State::Recording || currentState == State::Batching);
+  dstLayout = trackingState.mapLayout(dstLayout);
+  // rows of regions can be strided, so the whole buffer is read
+  transferRequests.buffers.emplace_back(&src, 0, VK_WHOLE_SIZE, BufferState {
     .activeStages = vk::PipelineStageFlagBits2::eTransfer,
     .activeAccesses = vk::AccessFlagBits2::eTransferRead
   });
@@ -219,28 +425,31 @@ void SyncCommandBuffer::copyBufferToImage(const Buffer &src, const Image &dst, v
   for (auto &region : regions)
   {
     vk::ImageSubresourceRange range {
+      .aspectMask = region.imageSubresource.aspectMask,
       .baseMipLevel = region.imageSubresource.mipLevel,
       .levelCount = 1,
       .baseArrayLayer = region.imageSubresource.baseArrayLayer,
       .layerCount = region.imageSubresource.layerCount
     };
 
-    trackingState.requestState(dst, range, ImageSubresState {
+    transferRequests.images.emplace_back(&dst, range, ImageSubresState {
       .activeStages = vk::PipelineStageFlagBits2::eTransfer,
       .activeAccesses = vk::AccessFlagBits2::eTransferWrite,
       .layout = dstLayout
     });
   }
 
-  flushBarrier();
-
-  cmd->copyBufferToImage(src.get(), dst.get(), dstLayout, regions);
+  requestTransferStates();
+  recordTransfer([srcBuffer = src.get(), dstImage = dst.get(), dstLayout,
+    copyRegions = std::vector(regions.begin(), regions.end())](vk::CommandBuffer cmd) {
+      cmd.copyBufferToImage(srcBuffer, dstImage, dstLayout, copyRegions);
+    });
 }
 
 void SyncCommandBuffer::transformLayout(const Image &image, vk::ImageLayout layout, 
   vk::ImageSubresourceRange range)
 {
-  ETNA_ASSERT(currentState == State::Recording);
+  ETNA_ASSERT(currentState == State::Recording && !unsynchronized);
   ImageSubresState state {
     .activeStages = vk::PipelineStageFlags2{},
     .activeAccesses = vk::AccessFlags2{},
@@ -253,51 +462,233 @@ void SyncCommandBuffer::transformLayout(const Image &image, vk::ImageLayout layo
   flushBarrier();
 }
 
+void SyncCommandBuffer::discard(const Image &image, vk::ImageSubresourceRange range)
+{
+  ETNA_ASSERT(currentState == State::Recording || currentState == State::Batching);
+  ETNA_ASSERT(!unsynchronized);
+  trackingState.discard(image, range);
+}
+
+// loadOp doesn't read old contents, but only inside the render area
+static bool overwrites_attachment(const RenderingAttachment &attachment, vk::Rect2D area)
+{
+  if (attachment.loadOp == vk::AttachmentLoadOp::eLoad)
+    return false;
+
+  auto extent = attachment.view.getOwner().getInfo().extent;
+  auto mip = attachment.view.getRange().baseMipLevel;
+  return area.offset.x <= 0 && area.offset.y <= 0
+    && area.offset.x + int64_t(area.extent.width) >= std::max(extent.width >> mip, 1u)
+    && area.offset.y + int64_t(area.extent.height) >= std::max(extent.height >> mip, 1u);
+}
+
+// passes render to one layer, the other layers of a layered view keep their contents
+static vk::ImageSubresourceRange rendered_range(vk::ImageSubresourceRange range)
+{
+  range.layerCount = 1;
+  return range;
+}
+
+// without a compatible pipeline bound first all stages of the set layout are assumed.
+// Bound sets are requested again with the stages of a new program in bindPipeline
+static std::span<const vk::ShaderStageFlags> binding_stages(ShaderProgramId program, 
+  uint32_t set_index, const DescriptorSet &set)
+{
+  if (program == INVALID_SHADER_PROGRAM_ID)
+    return {};
+  auto info = etna::get_shader_program(program);
+  if (info.isDescriptorSetUsed(set_index) && info.getDescriptorLayoutId(set_index) == set.getLayoutId())
+    return info.getBindingStages(set_index);
+  return {};
+}
+
+// decorations are per program, with another layout both storage read and write are assumed
+static std::span<const vk::AccessFlags2> binding_storage_access(ShaderProgramId program,
+  uint32_t set_index, const DescriptorSet &set)
+{
+  if (program == INVALID_SHADER_PROGRAM_ID)
+    return {};
+  auto info = etna::get_shader_program(program);
+  if (info.isDescriptorSetUsed(set_index) && info.getDescriptorLayoutId(set_index) == set.getLayoutId())
+    return info.getBindingStorageAccess(set_index);
+  return {};
+}
+
+// A set left bound across a pipeline switch is accessed by the new program, which may use its bindings
+// in other stages or write storage the previous one only read. False if the program doesn't access it
+static bool request_for_program(CmdBufferTrackingState &state, ShaderProgramId program,
+  uint32_t set_index, const DescriptorSet &set)
+{
+  if (program == INVALID_SHADER_PROGRAM_ID)
+    return false;
+  auto info = etna::get_shader_program(program);
+  if (!info.isDescriptorSetUsed(set_index) || info.getDescriptorLayoutId(set_index) != set.getLayoutId())
+    return false;
+  set.requestStates(state, info.getBindingStages(set_index), info.getBindingStorageAccess(set_index));
+  return true;
+}
+
+static vk::PushConstantRange push_constants_range(ShaderProgramId program, uint32_t offset, uint32_t size)
+{
+  auto constInfo = etna::get_shader_program(program).getPushConst();
+  ETNA_ASSERTF(constInfo.size > 0, "Shader program {} doesn't have push constants", program);
+  ETNA_ASSERTF(offset + size <= constInfo.size, "pushConstants: out of range");
+  return constInfo;
+}
+
+// bytes read by an indirect command, the last command may be shorter than the stride
+static vk::DeviceSize indirect_size(uint32_t draw_count, uint32_t stride, vk::DeviceSize command_size)
+{
+  return draw_count == 0 ? 0 : vk::DeviceSize(draw_count - 1) * stride + command_size;
+}
+
+// argument and count buffers are read at the DrawIndirect stage, for both draws and dispatches
+static void request_indirect_args(CmdBufferTrackingState &state, const Buffer &buffer,
+  vk::DeviceSize offset, vk::DeviceSize size)
+{
+  if (size == 0)
+    return;
+  state.requestState(buffer, offset, size, BufferState {
+    vk::PipelineStageFlagBits2::eDrawIndirect,
+    vk::AccessFlagBits2::eIndirectCommandRead
+  });
+}
+
 void SyncCommandBuffer::bindDescriptorSet(vk::PipelineBindPoint bind_point, 
     vk::PipelineLayout layout, uint32_t set_index, 
     const DescriptorSet &set, std::span<const uint32_t> dynamic_offsets)
 {
-  set.requestStates(trackingState);
+  bool graphics = bind_point == vk::PipelineBindPoint::eGraphics;
+  if (graphics)
+    ETNA_ASSERT(currentState == State::Rendering && usedParallelContexts == 0);
+  else
+    ETNA_ASSERT(currentState == State::Recording);
 
-  if (bind_point == vk::PipelineBindPoint::eGraphics)
+  auto program = boundProgram(bind_point);
+  if (set_index < MAX_PROGRAM_DESCRIPTORS)
+    boundSetsFor(bind_point)[set_index].emplace(set);
+  auto *entry = stateFiltering && dynamic_offsets.empty() && set_index < MAX_PROGRAM_DESCRIPTORS
+    ? &boundState(bind_point).sets[set_index] : nullptr;
+  bool bound = entry && entry->set == set.getVkSet() && entry->layout == layout;
+
+  if (!unsynchronized)
+  {
+    if (bound && entry->program == program && entry->requestedAt == flushCount)
+      filterStats.skippedRequests++;
+    else
+      set.requestStates(trackingState, binding_stages(program, set_index, set),
+        binding_storage_access(program, set_index, set));
+  }
+
+  if (entry)
+    *entry = BoundState::Set {set.getVkSet(), layout, program, unsynchronized? BoundState::NOT_REQUESTED : flushCount};
+  else if (stateFiltering && set_index < MAX_PROGRAM_DESCRIPTORS)
+    boundState(bind_point).sets[set_index] = BoundState::Set {}; // not cached, the next bind to the slot is recorded
+  if (bound)
   {
-    ETNA_ASSERT(currentState == State::Rendering);
-    renderCmd.value()->bindDescriptorSets(bind_point, layout, set_index, {set.getVkSet()}, dynamic_offsets);
+    filterStats.filteredCalls++;
     return;
   }
 
-  ETNA_ASSERT(currentState == State::Recording);
-  cmd->bindDescriptorSets(bind_point, layout, set_index, {set.getVkSet()}, dynamic_offsets);
+  if (!graphics)
+    cmd->bindDescriptorSets(bind_point, layout, set_index, {set.getVkSet()}, dynamic_offsets);
+  else if (renderCmd.has_value())
+    renderCmd->bindDescriptorSets(bind_point, layout, set_index, {set.getVkSet()}, dynamic_offsets);
+  else
+    renderCommands.bindDescriptorSet(bind_point, layout, set_index, set.getVkSet(), dynamic_offsets);
 }
 
 void SyncCommandBuffer::bindPipeline(vk::PipelineBindPoint bind_point, const PipelineBase &pipeline)
 {
-  if (bind_point == vk::PipelineBindPoint::eGraphics){
-    ETNA_ASSERT(currentState == State::Rendering);
-    renderCmd.value()->bindPipeline(bind_point, pipeline.getVkPipeline());
-    return;
+  bool graphics = bind_point == vk::PipelineBindPoint::eGraphics;
+  if (graphics)
+    ETNA_ASSERT(currentState == State::Rendering && usedParallelContexts == 0);
+  else
+    ETNA_ASSERT(currentState == State::Recording);
+
+  auto program = pipeline.getShaderProgram();
+  bool programChanged = boundProgram(bind_point) != program;
+  boundProgram(bind_point) = program;
+  auto vkPipeline = pipeline.getVkPipeline();
+  if (stateFiltering)
+  {
+    auto &bound = boundState(bind_point);
+    if (bound.pipeline == vkPipeline)
+    {
+      filterStats.filteredCalls++;
+      return;
+    }
+    bound.pipeline = vkPipeline;
+    // sets bound with other layouts may be disturbed by the new pipeline
+    auto layout = pipeline.getVkPipelineLayout();
+    for (auto &set : bound.sets)
+      if (set.layout != layout)
+        set = BoundState::Set {};
   }
-  ETNA_ASSERT(currentState == State::Recording);
-  cmd->bindPipeline(bind_point, pipeline.getVkPipeline());
+
+  if (programChanged && !unsynchronized)
+  {
+    auto &sets = boundSetsFor(bind_point);
+    for (uint32_t i = 0; i < MAX_PROGRAM_DESCRIPTORS; i++)
+    {
+      if (!sets[i].has_value() || !request_for_program(trackingState, program, i, *sets[i]))
+        continue;
+      auto &entry = boundState(bind_point).sets[i];
+      if (stateFiltering && entry.set == sets[i]->getVkSet())
+      {
+        entry.program = program;
+        entry.requestedAt = flushCount;
+      }
+    }
+  }
+
+  if (!graphics)
+    cmd->bindPipeline(bind_point, vkPipeline);
+  else if (renderCmd.has_value())
+    renderCmd->bindPipeline(bind_point, vkPipeline);
+  else
+    renderCommands.bindPipeline(bind_point, vkPipeline);
 }
 
 void SyncCommandBuffer::dispatch(uint32_t groups_x, uint32_t groups_y, uint32_t groups_z)
 {
   ETNA_ASSERT(currentState == State::Recording);
+  if (unsynchronized)
+  {
+    cmd->dispatch(groups_x, groups_y, groups_z);
+    return;
+  }
+
   flushBarrier();
   cmd->dispatch(groups_x, groups_y, groups_z);
+  signalWrites();
+}
+
+void SyncCommandBuffer::dispatchIndirect(const Buffer &buffer, vk::DeviceSize offset)
+{
+  ETNA_ASSERT(currentState == State::Recording);
+  if (unsynchronized)
+  {
+    cmd->dispatchIndirect(buffer.get(), offset);
+    return;
+  }
+
+  request_indirect_args(trackingState, buffer, offset, sizeof(vk::DispatchIndirectCommand));
+  flushBarrier();
+  cmd->dispatchIndirect(buffer.get(), offset);
+  signalWrites();
 }
 
 void SyncCommandBuffer::pushConstants(ShaderProgramId program, uint32_t offset, uint32_t size, const void *data)
 {
   auto info = etna::get_shader_program(program);
-  auto constInfo = info.getPushConst();
-  
-  ETNA_ASSERTF(constInfo.size > 0, "Shader program {} doesn't have push constants", program);
-  ETNA_ASSERTF(offset + size <= constInfo.size, "pushConstants: out of range");
+  auto constInfo = push_constants_range(program, offset, size);
+  ETNA_ASSERT(currentState != State::Rendering || usedParallelContexts == 0);
 
-  if (currentState == State::Rendering)
-    renderCmd.value()->pushConstants(info.getPipelineLayout(), constInfo.stageFlags, offset, size, data);
+  if (currentState == State::Rendering && renderCmd.has_value())
+    renderCmd->pushConstants(info.getPipelineLayout(), constInfo.stageFlags, offset, size, data);
+  else if (currentState == State::Rendering)
+    renderCommands.pushConstants(info.getPipelineLayout(), constInfo.stageFlags, offset, size, data);
   else
   {
     ETNA_ASSERT(currentState == State::Recording);
@@ -310,10 +701,9 @@ void SyncCommandBuffer::beginRendering(vk::Rect2D area,
     std::optional<RenderingAttachment> depth_attachment,
     std::optional<RenderingAttachment> stencil_attachment)
 {
-  ETNA_ASSERT(currentState == State::Recording);
+  ETNA_ASSERT(currentState == State::Recording && !unsynchronized);
 
   std::vector<vk::RenderingAttachmentInfo> colorInfos;
-  std::vector<vk::Format> colorFmt;
 
   for (auto &colorAttachment : color_attachments)
   {
@@ -323,6 +713,9 @@ void SyncCommandBuffer::beginRendering(vk::Rect2D area,
     auto &image = colorAttachment.view.getOwner();
     auto range = colorAttachment.view.getRange();
 
+    if (overwrites_attachment(colorAttachment, area))
+      trackingState.discard(image, rendered_range(range));
+
     trackingState.requestState(
       image, 
       range,
@@ -332,10 +725,9 @@ void SyncCommandBuffer::beginRendering(vk::Rect2D area,
         .layout = colorAttachment.layout
       }); 
 
-    colorFmt.push_back(image.getInfo().format);
     vk::RenderingAttachmentInfo info {
       .imageView = vk::ImageView(colorAttachment.view),
-      .imageLayout = colorAttachment.layout,
+      .imageLayout = trackingState.mapLayout(colorAttachment.layout),
       .resolveMode = vk::ResolveModeFlagBits::eNone,
       .loadOp = colorAttachment.loadOp,
       .storeOp = colorAttachment.storeOp,
@@ -345,24 +737,22 @@ void SyncCommandBuffer::beginRendering(vk::Rect2D area,
     colorInfos.push_back(info);
   }
 
-  vk::Format depthFormat {vk::Format::eUndefined};
-  vk::Format stencilFormat {vk::Format::eUndefined};
-  std::optional<vk::RenderingAttachmentInfo> depthAttachment;
-  // tricky part. currently barriers don't support separate aspect mask, so 
-  // we need to make layout transitions both for depth and stencil
-  // For now depth and stencil should point to the same image if used
-  if (depth_attachment && stencil_attachment) 
-  {
-    ETNA_ASSERT(depth_attachment->view.getOwner().get() == stencil_attachment->view.getOwner().get());
-    ETNA_ASSERTF(false, "Stencil not supported yet :(");
-  }
-  else if (depth_attachment)
-  {
-    auto layout = depth_attachment->layout;
-    bool readOnly = layout == vk::ImageLayout::eDepthStencilReadOnlyOptimal;
-    auto &image = depth_attachment->view.getOwner();
-    auto range = depth_attachment->view.getRange();
-    
+  // depth and stencil aspects are tracked separately, so with split layouts like 
+  // eDepthReadOnlyStencilAttachmentOptimal one aspect stays read-only while the other is written
+  auto requestAspect = [&](const RenderingAttachment &attachment, vk::ImageAspectFlagBits aspect) {
+    auto &image = attachment.view.getOwner();
+    auto range = attachment.view.getRange();
+    ETNA_ASSERTF(range.aspectMask & aspect, "Attachment view doesn't have required aspect");
+    range.aspectMask = aspect;
+
+    if (overwrites_attachment(attachment, area))
+      trackingState.discard(image, rendered_range(range));
+
+    auto aspectLayout = tracking::aspect_layout(aspect, attachment.layout);
+    bool readOnly = aspectLayout == vk::ImageLayout::eDepthReadOnlyOptimal
+      || aspectLayout == vk::ImageLayout::eStencilReadOnlyOptimal
+      || aspectLayout == vk::ImageLayout::eReadOnlyOptimal;
+
     auto stages = vk::PipelineStageFlagBits2::eEarlyFragmentTests
       | vk::PipelineStageFlagBits2::eLateFragmentTests;
 
@@ -370,37 +760,66 @@ void SyncCommandBuffer::beginRendering(vk::Rect2D area,
     if (!readOnly)
       access |= vk::AccessFlagBits2::eDepthStencilAttachmentWrite;
 
-    trackingState.requestState(image, range, ImageSubresState{stages, access, layout});
+    trackingState.requestState(image, range, ImageSubresState{stages, access, attachment.layout});
 
-    depthFormat = image.getInfo().format;
-    depthAttachment = vk::RenderingAttachmentInfo {
-      .imageView = vk::ImageView(depth_attachment->view),
-      .imageLayout = layout,
+    return vk::RenderingAttachmentInfo {
+      .imageView = vk::ImageView(attachment.view),
+      .imageLayout = trackingState.mapLayout(attachment.layout),
       .resolveMode = vk::ResolveModeFlagBits::eNone,
-      .loadOp = depth_attachment->loadOp,
-      .storeOp = depth_attachment->storeOp,
-      .clearValue = depth_attachment->clearValue
+      .loadOp = attachment.loadOp,
+      .storeOp = attachment.storeOp,
+      .clearValue = attachment.clearValue
     };
-  }
-  else if (stencil_attachment)
+  };
+
+  // Vulkan requires the same view for depth and stencil attachments if both are used
+  if (depth_attachment && stencil_attachment) 
   {
-    ETNA_ASSERTF(false, "Stencil not supported yet :(");
+    ETNA_ASSERT(vk::ImageView(depth_attachment->view) == vk::ImageView(stencil_attachment->view));
   }
 
+  std::optional<vk::RenderingAttachmentInfo> depthAttachment;
+  if (depth_attachment)
+    depthAttachment = requestAspect(*depth_attachment, vk::ImageAspectFlagBits::eDepth);
+
+  std::optional<vk::RenderingAttachmentInfo> stencilAttachment;
+  if (stencil_attachment)
+    stencilAttachment = requestAspect(*stencil_attachment, vk::ImageAspectFlagBits::eStencil);
+
   renderState.emplace(RenderInfo{});
   renderState->renderArea = area;
   renderState->colorAttachments = colorInfos;
+  for (auto &colorAttachment : color_attachments)
+    renderState->colorFormats.push_back(colorAttachment.view.getOwner().getInfo().format);
+  if (depth_attachment)
+    renderState->depthFormat = depth_attachment->view.getOwner().getInfo().format;
+  if (stencil_attachment)
+    renderState->stencilFormat = stencil_attachment->view.getOwner().getInfo().format;
 
   if (depthAttachment.has_value())
     renderState->depthAttachment.emplace(*depthAttachment);
+  if (stencilAttachment.has_value())
+    renderState->stencilAttachment.emplace(*stencilAttachment);
 
-  renderCmd.emplace(pool.allocateSecondary());
-  
+  // graphics pipelines are bound inside render passes only, a new pass starts without one
+  boundProgram(vk::PipelineBindPoint::eGraphics) = INVALID_SHADER_PROGRAM_ID;
+  renderBound.clear();
+  currentState = State::Rendering;
+
+  if (!secondaryRenderPasses)
+    return;
+
+  renderCmd.emplace(secondaryCmds.acquire());
+  beginSecondary(*renderCmd);
+}
+
+void SyncCommandBuffer::beginSecondary(vk::CommandBuffer secondary)
+{
   vk::CommandBufferInheritanceRenderingInfo secondaryInfo {
-    .colorAttachmentCount = colorFmt.size(),
-    .pColorAttachmentFormats = colorFmt.data(),
-    .depthAttachmentFormat = depthFormat,
-    .stencilAttachmentFormat = stencilFormat
+    .colorAttachmentCount = static_cast<uint32_t>(renderState->colorFormats.size()),
+    .pColorAttachmentFormats = renderState->colorFormats.data(),
+    .depthAttachmentFormat = renderState->depthFormat,
+    .stencilAttachmentFormat = renderState->stencilFormat
   };
   
   vk::CommandBufferInheritanceInfo inheritanceInfo {
@@ -412,105 +831,466 @@ void SyncCommandBuffer::beginRendering(vk::Rect2D area,
     .pInheritanceInfo = &inheritanceInfo
   };
 
-  auto res = renderCmd.value()->begin(beginInfo);
+  auto res = secondary.begin(beginInfo);
   ETNA_ASSERT(res == vk::Result::eSuccess);
-  currentState = State::Rendering;
 }
-  
+
+void SyncCommandBuffer::beginParallelRecording(uint32_t count)
+{
+  ETNA_ASSERT(currentState == State::Rendering && !unsynchronized);
+  ETNA_ASSERTF(!renderCmd.has_value(), "Parallel recording is not available with secondary render passes");
+  ETNA_ASSERTF(usedParallelContexts == 0, "Parallel recording already started for this render pass");
+  ETNA_ASSERT(count > 0);
+
+  while (parallelContexts.size() < count)
+    parallelContexts.push_back(std::make_unique<ParallelRenderContext>(pool.getQueueType()));
+
+  for (uint32_t i = 0; i < count; i++)
+  {
+    auto &context = *parallelContexts[i];
+    context.cmd = context.pool.acquire();
+    context.boundProgram = boundProgram(vk::PipelineBindPoint::eGraphics);
+    // sets hold bindings by reference, so they are copy constructed rather than assigned
+    for (uint32_t set = 0; set < MAX_PROGRAM_DESCRIPTORS; set++)
+    {
+      context.boundSets[set].reset();
+      if (auto &bound = boundSetsFor(vk::PipelineBindPoint::eGraphics)[set])
+        context.boundSets[set].emplace(*bound);
+    }
+    context.trackingState.setLayoutPolicy(trackingState.getLayoutPolicy());
+    beginSecondary(context.cmd);
+    // secondaries don't inherit state, every context starts with the state set up so far.
+    // Draws recorded before go only to the first context, it is executed first
+    renderCommands.replay(context.cmd, i > 0);
+  }
+  renderCommands.clear();
+  usedParallelContexts = count;
+}
+
+ParallelRenderContext::ParallelRenderContext(QueueType queue_type)
+  : pool {queue_type}
+{}
+
+void ParallelRenderContext::bindPipeline(const GraphicsPipeline &pipeline)
+{
+  if (boundProgram != pipeline.getShaderProgram())
+  {
+    for (uint32_t i = 0; i < MAX_PROGRAM_DESCRIPTORS; i++)
+      if (boundSets[i].has_value())
+        request_for_program(trackingState, pipeline.getShaderProgram(), i, *boundSets[i]);
+  }
+  boundProgram = pipeline.getShaderProgram();
+  cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline.getVkPipeline());
+}
+
+void ParallelRenderContext::bindDescriptorSet(vk::PipelineLayout layout, uint32_t set_index, 
+  const DescriptorSet &set, std::span<const uint32_t> dynamic_offsets)
+{
+  set.requestStates(trackingState, binding_stages(boundProgram, set_index, set),
+    binding_storage_access(boundProgram, set_index, set));
+  if (set_index < MAX_PROGRAM_DESCRIPTORS)
+    boundSets[set_index].emplace(set);
+  cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, layout, set_index, {set.getVkSet()}, dynamic_offsets);
+}
+
+void ParallelRenderContext::pushConstants(ShaderProgramId program, uint32_t offset, uint32_t size, const void *data)
+{
+  auto constInfo = push_constants_range(program, offset, size);
+  cmd.pushConstants(etna::get_shader_program(program).getPipelineLayout(), constInfo.stageFlags, offset, size, data);
+}
+
+void ParallelRenderContext::bindVertexBuffer(uint32_t binding_index, const Buffer &buffer, vk::DeviceSize offset)
+{
+  trackingState.requestState(buffer, offset, VK_WHOLE_SIZE, BufferState {
+    vk::PipelineStageFlagBits2::eVertexInput,
+    vk::AccessFlagBits2::eVertexAttributeRead
+  });
+  cmd.bindVertexBuffers(binding_index, {buffer.get()}, {offset});
+}
+
+void ParallelRenderContext::bindIndexBuffer(const Buffer &buffer, uint32_t offset, vk::IndexType type)
+{
+  trackingState.requestState(buffer, offset, VK_WHOLE_SIZE, BufferState {
+    vk::PipelineStageFlagBits2::eIndexInput,
+    vk::AccessFlagBits2::eIndexRead
+  });
+  cmd.bindIndexBuffer(buffer.get(), offset, type);
+}
+
+void ParallelRenderContext::draw(uint32_t vertex_count, uint32_t instance_count, 
+  uint32_t first_vertex, uint32_t first_index)
+{
+  cmd.draw(vertex_count, instance_count, first_vertex, first_index);
+}
+
+void ParallelRenderContext::drawIndexed(uint32_t index_cout, uint32_t instance_count, 
+    uint32_t first_index, uint32_t vertex_offset, uint32_t first_instance)
+{
+  cmd.drawIndexed(index_cout, instance_count, first_index, vertex_offset, first_instance);
+}
+
+void ParallelRenderContext::drawIndirect(const Buffer &buffer, vk::DeviceSize offset,
+  uint32_t draw_count, uint32_t stride)
+{
+  request_indirect_args(trackingState, buffer, offset, indirect_size(draw_count, stride, sizeof(vk::DrawIndirectCommand)));
+  cmd.drawIndirect(buffer.get(), offset, draw_count, stride);
+}
+
+void ParallelRenderContext::drawIndexedIndirect(const Buffer &buffer, vk::DeviceSize offset,
+  uint32_t draw_count, uint32_t stride)
+{
+  request_indirect_args(trackingState, buffer, offset,
+    indirect_size(draw_count, stride, sizeof(vk::DrawIndexedIndirectCommand)));
+  cmd.drawIndexedIndirect(buffer.get(), offset, draw_count, stride);
+}
+
+void ParallelRenderContext::drawIndirectCount(const Buffer &buffer, vk::DeviceSize offset,
+  const Buffer &count_buffer, vk::DeviceSize count_offset, uint32_t max_draw_count, uint32_t stride)
+{
+  ETNA_ASSERTF(etna::get_context().supportsDrawIndirectCount(), "drawIndirectCount: VK_KHR_draw_indirect_count is not supported");
+  request_indirect_args(trackingState, buffer, offset,
+    indirect_size(max_draw_count, stride, sizeof(vk::DrawIndirectCommand)));
+  request_indirect_args(trackingState, count_buffer, count_offset, sizeof(uint32_t));
+  cmd.drawIndirectCountKHR(buffer.get(), offset, count_buffer.get(), count_offset, max_draw_count, stride);
+}
+
+void ParallelRenderContext::drawIndexedIndirectCount(const Buffer &buffer, vk::DeviceSize offset,
+  const Buffer &count_buffer, vk::DeviceSize count_offset, uint32_t max_draw_count, uint32_t stride)
+{
+  ETNA_ASSERTF(etna::get_context().supportsDrawIndirectCount(), "drawIndexedIndirectCount: VK_KHR_draw_indirect_count is not supported");
+  request_indirect_args(trackingState, buffer, offset,
+    indirect_size(max_draw_count, stride, sizeof(vk::DrawIndexedIndirectCommand)));
+  request_indirect_args(trackingState, count_buffer, count_offset, sizeof(uint32_t));
+  cmd.drawIndexedIndirectCountKHR(buffer.get(), offset, count_buffer.get(), count_offset, max_draw_count, stride);
+}
+
+void ParallelRenderContext::setViewport(uint32_t first_viewport, vk::ArrayProxy<const vk::Viewport> viewports)
+{
+  cmd.setViewport(first_viewport, viewports);
+}
+
+void ParallelRenderContext::setScissor(uint32_t first_scissor, vk::ArrayProxy<const vk::Rect2D> scissors)
+{
+  cmd.setScissor(first_scissor, scissors);
+}
+
 void SyncCommandBuffer::endRendering()
 {
-  ETNA_ASSERT(currentState == State::Rendering);
-  ETNA_ASSERT(renderState.has_value() && renderCmd.has_value());
+  ETNA_ASSERT(currentState == State::Rendering && !unsynchronized);
+  ETNA_ASSERT(renderState.has_value());
 
-  renderCmd.value()->end();
+  if (renderCmd.has_value())
+    renderCmd->end();
 
+  // contexts are done by now, their requests are merged in a fixed order
+  for (uint32_t i = 0; i < usedParallelContexts; i++)
+  {
+    auto &context = *parallelContexts[i];
+    auto res = context.cmd.end();
+    ETNA_ASSERT(res == vk::Result::eSuccess);
+    trackingState.takeRequests(context.trackingState);
+  }
+
+  // barriers for everything used in the pass go before it
   flushBarrier();
 
+  bool secondaries = renderCmd.has_value() || usedParallelContexts > 0;
   vk::RenderingInfo vkRenderInfo {
-    .flags = vk::RenderingFlagBits::eContentsSecondaryCommandBuffers,
+    .flags = secondaries? vk::RenderingFlagBits::eContentsSecondaryCommandBuffers : vk::RenderingFlags{},
     .renderArea = renderState->renderArea,
     .layerCount = 1,
     .colorAttachmentCount = renderState->colorAttachments.size(),
     .pColorAttachments = renderState->colorAttachments.data(),
-    .pDepthAttachment = renderState->depthAttachment.has_value()? &renderState->depthAttachment.value() : nullptr    
+    .pDepthAttachment = renderState->depthAttachment.has_value()? &renderState->depthAttachment.value() : nullptr,
+    .pStencilAttachment = renderState->stencilAttachment.has_value()? &renderState->stencilAttachment.value() : nullptr
   };
 
   cmd->beginRendering(vkRenderInfo);
-  cmd->executeCommands({renderCmd.value().get()});
+  if (renderCmd.has_value())
+    cmd->executeCommands({*renderCmd});
+  else if (usedParallelContexts > 0)
+  {
+    executedContexts.clear();
+    for (uint32_t i = 0; i < usedParallelContexts; i++)
+      executedContexts.push_back(parallelContexts[i]->cmd);
+    cmd->executeCommands(executedContexts);
+  }
+  else
+    renderCommands.replay(*cmd);
   cmd->endRendering();
+  signalWrites();
+  if (secondaries)
+  {
+    computeBound.clear();
+    for (auto &sets : boundSets)
+      sets.fill(std::nullopt);
+  }
 
   currentState = State::Recording;
-  usedRenderCmd.emplace_back(std::move(renderCmd).value());
+  renderCmd.reset();
+  renderCommands.clear();
+  usedParallelContexts = 0;
 }
 
 void SyncCommandBuffer::bindVertexBuffer(uint32_t binding_index, const Buffer &buffer, vk::DeviceSize offset)
 {
-  ETNA_ASSERT(currentState == State::Rendering);
-  trackingState.requestState(buffer, BufferState {
-    vk::PipelineStageFlagBits2::eVertexInput,
-    vk::AccessFlagBits2::eVertexAttributeRead
-  });
+  ETNA_ASSERT(currentState == State::Rendering && usedParallelContexts == 0);
+  auto *entry = stateFiltering && binding_index < renderBound.vertexBuffers.size()
+    ? &renderBound.vertexBuffers[binding_index] : nullptr;
+  bool bound = entry && entry->buffer == buffer.getId() && entry->offset == offset;
+
+  if (bound && !unsynchronized && entry->requestedAt == flushCount)
+    filterStats.skippedRequests++;
+  else if (!unsynchronized)
+  {
+    trackingState.requestState(buffer, offset, VK_WHOLE_SIZE, BufferState {
+      vk::PipelineStageFlagBits2::eVertexInput,
+      vk::AccessFlagBits2::eVertexAttributeRead
+    });
+  }
+
+  if (entry)
+    *entry = BoundState::BufferBinding {buffer.getId(), offset, {}, unsynchronized? BoundState::NOT_REQUESTED : flushCount};
+  if (bound)
+  {
+    filterStats.filteredCalls++;
+    return;
+  }
 
-  renderCmd.value()->bindVertexBuffers(binding_index, {buffer.get()}, {offset});
+  if (renderCmd.has_value())
+    renderCmd->bindVertexBuffers(binding_index, {buffer.get()}, {offset});
+  else
+    renderCommands.bindVertexBuffer(binding_index, buffer.get(), offset);
 }
 
 void SyncCommandBuffer::bindIndexBuffer(const Buffer &buffer, uint32_t offset, vk::IndexType type)
 {
-  ETNA_ASSERT(currentState == State::Rendering);
-  trackingState.requestState(buffer, BufferState {
-    vk::PipelineStageFlagBits2::eIndexInput,
-    vk::AccessFlagBits2::eIndexRead
-  });
+  ETNA_ASSERT(currentState == State::Rendering && usedParallelContexts == 0);
+  auto &entry = renderBound.indexBuffer;
+  bool bound = stateFiltering && entry.buffer == buffer.getId() && entry.offset == offset && entry.type == type;
+
+  if (bound && !unsynchronized && entry.requestedAt == flushCount)
+    filterStats.skippedRequests++;
+  else if (!unsynchronized)
+  {
+    trackingState.requestState(buffer, offset, VK_WHOLE_SIZE, BufferState {
+      vk::PipelineStageFlagBits2::eIndexInput,
+      vk::AccessFlagBits2::eIndexRead
+    });
+  }
+
+  if (stateFiltering)
+    entry = BoundState::BufferBinding {buffer.getId(), offset, type, unsynchronized? BoundState::NOT_REQUESTED : flushCount};
+  if (bound)
+  {
+    filterStats.filteredCalls++;
+    return;
+  }
 
-  renderCmd.value()->bindIndexBuffer(buffer.get(), offset, type);
+  if (renderCmd.has_value())
+    renderCmd->bindIndexBuffer(buffer.get(), offset, type);
+  else
+    renderCommands.bindIndexBuffer(buffer.get(), offset, type);
 }
 
 void SyncCommandBuffer::draw(uint32_t vertex_count, uint32_t instance_count, 
   uint32_t first_vertex, uint32_t first_index)
 {
-  ETNA_ASSERT(currentState == State::Rendering);
-  renderCmd.value()->draw(vertex_count, instance_count, first_vertex, first_index);
+  ETNA_ASSERT(currentState == State::Rendering && usedParallelContexts == 0);
+  if (renderCmd.has_value())
+    renderCmd->draw(vertex_count, instance_count, first_vertex, first_index);
+  else
+    renderCommands.draw(vertex_count, instance_count, first_vertex, first_index);
 }
 
 void SyncCommandBuffer::drawIndexed(uint32_t index_cout, uint32_t instance_count, 
     uint32_t first_index, uint32_t vertex_offset, uint32_t first_instance)
 {
-  ETNA_ASSERT(currentState == State::Rendering);
-  renderCmd.value()->drawIndexed(index_cout, instance_count, first_index, vertex_offset, first_instance);
+  ETNA_ASSERT(currentState == State::Rendering && usedParallelContexts == 0);
+  if (renderCmd.has_value())
+    renderCmd->drawIndexed(index_cout, instance_count, first_index, vertex_offset, first_instance);
+  else
+    renderCommands.drawIndexed(index_cout, instance_count, first_index, vertex_offset, first_instance);
+}
+
+void SyncCommandBuffer::drawIndirect(const Buffer &buffer, vk::DeviceSize offset, uint32_t draw_count, uint32_t stride)
+{
+  ETNA_ASSERT(currentState == State::Rendering && usedParallelContexts == 0);
+  if (!unsynchronized)
+    request_indirect_args(trackingState, buffer, offset, indirect_size(draw_count, stride, sizeof(vk::DrawIndirectCommand)));
+
+  if (renderCmd.has_value())
+    renderCmd->drawIndirect(buffer.get(), offset, draw_count, stride);
+  else
+    renderCommands.drawIndirect(buffer.get(), offset, draw_count, stride);
+}
+
+void SyncCommandBuffer::drawIndexedIndirect(const Buffer &buffer, vk::DeviceSize offset,
+  uint32_t draw_count, uint32_t stride)
+{
+  ETNA_ASSERT(currentState == State::Rendering && usedParallelContexts == 0);
+  if (!unsynchronized)
+  {
+    request_indirect_args(trackingState, buffer, offset,
+      indirect_size(draw_count, stride, sizeof(vk::DrawIndexedIndirectCommand)));
+  }
+
+  if (renderCmd.has_value())
+    renderCmd->drawIndexedIndirect(buffer.get(), offset, draw_count, stride);
+  else
+    renderCommands.drawIndexedIndirect(buffer.get(), offset, draw_count, stride);
+}
+
+void SyncCommandBuffer::drawIndirectCount(const Buffer &buffer, vk::DeviceSize offset, const Buffer &count_buffer,
+  vk::DeviceSize count_offset, uint32_t max_draw_count, uint32_t stride)
+{
+  ETNA_ASSERT(currentState == State::Rendering && usedParallelContexts == 0);
+  ETNA_ASSERTF(etna::get_context().supportsDrawIndirectCount(), "drawIndirectCount: VK_KHR_draw_indirect_count is not supported");
+  if (!unsynchronized)
+  {
+    request_indirect_args(trackingState, buffer, offset,
+      indirect_size(max_draw_count, stride, sizeof(vk::DrawIndirectCommand)));
+    request_indirect_args(trackingState, count_buffer, count_offset, sizeof(uint32_t));
+  }
+
+  if (renderCmd.has_value())
+    renderCmd->drawIndirectCountKHR(buffer.get(), offset, count_buffer.get(), count_offset, max_draw_count, stride);
+  else
+    renderCommands.drawIndirectCount(buffer.get(), offset, count_buffer.get(), count_offset, max_draw_count, stride);
+}
+
+void SyncCommandBuffer::drawIndexedIndirectCount(const Buffer &buffer, vk::DeviceSize offset,
+  const Buffer &count_buffer, vk::DeviceSize count_offset, uint32_t max_draw_count, uint32_t stride)
+{
+  ETNA_ASSERT(currentState == State::Rendering && usedParallelContexts == 0);
+  ETNA_ASSERTF(etna::get_context().supportsDrawIndirectCount(), "drawIndexedIndirectCount: VK_KHR_draw_indirect_count is not supported");
+  if (!unsynchronized)
+  {
+    request_indirect_args(trackingState, buffer, offset,
+      indirect_size(max_draw_count, stride, sizeof(vk::DrawIndexedIndirectCommand)));
+    request_indirect_args(trackingState, count_buffer, count_offset, sizeof(uint32_t));
+  }
+
+  if (renderCmd.has_value())
+    renderCmd->drawIndexedIndirectCountKHR(buffer.get(), offset, count_buffer.get(), count_offset, max_draw_count, stride);
+  else
+    renderCommands.drawIndexedIndirectCount(buffer.get(), offset, count_buffer.get(), count_offset, max_draw_count, stride);
 }
 
 void SyncCommandBuffer::setViewport(uint32_t first_viewport, vk::ArrayProxy<const vk::Viewport> viewports)
 {
-  ETNA_ASSERT(currentState == State::Rendering);
-  renderCmd.value()->setViewport(first_viewport, viewports);
+  ETNA_ASSERT(currentState == State::Rendering && usedParallelContexts == 0);
+  if (stateFiltering)
+  {
+    auto &bound = renderBound;
+    if (bound.firstViewport == first_viewport && std::equal(viewports.begin(), viewports.end(),
+      bound.viewports.begin(), bound.viewports.end()))
+    {
+      filterStats.filteredCalls++;
+      return;
+    }
+    bound.firstViewport = first_viewport;
+    bound.viewports.assign(viewports.begin(), viewports.end());
+  }
+
+  if (renderCmd.has_value())
+    renderCmd->setViewport(first_viewport, viewports);
+  else
+    renderCommands.setViewport(first_viewport, {viewports.data(), viewports.size()});
 }
 void SyncCommandBuffer::setScissor(uint32_t first_scissor, vk::ArrayProxy<const vk::Rect2D> scissors)
 {
-  ETNA_ASSERT(currentState == State::Rendering);
-  renderCmd.value()->setScissor(first_scissor, scissors);
+  ETNA_ASSERT(currentState == State::Rendering && usedParallelContexts == 0);
+  if (stateFiltering)
+  {
+    auto &bound = renderBound;
+    if (bound.firstScissor == first_scissor && std::equal(scissors.begin(), scissors.end(),
+      bound.scissors.begin(), bound.scissors.end()))
+    {
+      filterStats.filteredCalls++;
+      return;
+    }
+    bound.firstScissor = first_scissor;
+    bound.scissors.assign(scissors.begin(), scissors.end());
+  }
+
+  if (renderCmd.has_value())
+    renderCmd->setScissor(first_scissor, scissors);
+  else
+    renderCommands.setScissor(first_scissor, {scissors.data(), scissors.size()});
 }
 
 vk::Result SyncCommandBuffer::submit(const SubmitInfo *info, vk::Fence signalFence)
 {
   ETNA_ASSERT(currentState = State::Executable);
   currentState = State::Pending;
-  
-  etna::get_context().getQueueTrackingState() // handle error
-    .onSubmit(trackingState);
 
-  vk::SubmitInfo submitInfo {
-    .commandBufferCount = 1,
-    .pCommandBuffers = &cmd.get()
-  };
+  auto &context = etna::get_context();
+  auto &queue = context.getQueueContext(pool.getQueueType());
+
+  // release halves of ownership transfers are submitted to the previous owners first
+  std::vector<vk::SemaphoreSubmitInfo> waitInfos;
+  for (const auto &release : trackingState.getOwnershipReleases())
+  {
+    auto &owner = context.getQueueContext(*release.queue);
+    uint64_t value = owner.submitRelease(release);
+    waitInfos.push_back(vk::SemaphoreSubmitInfo {
+      .semaphore = owner.timeline.get(),
+      .value = value,
+      .stageMask = vk::PipelineStageFlagBits2::eAllCommands
+    });
+  }
+  
+  std::vector<vk::CommandBufferSubmitInfo> cmdInfos;
+  std::vector<vk::SemaphoreSubmitInfo> signalInfos;
+  if (fixupOnSubmit)
+  {
+    tracking::CmdBarrier prologue;
+    queue.tracking.onSubmit(trackingState, &prologue);
+    if (!prologue.empty())
+    {
+      auto [prologueCmd, value] = queue.recordPrologue(prologue);
+      cmdInfos.push_back(vk::CommandBufferSubmitInfo{.commandBuffer = prologueCmd});
+      signalInfos.push_back(vk::SemaphoreSubmitInfo {
+        .semaphore = queue.timeline.get(),
+        .value = value,
+        .stageMask = vk::PipelineStageFlagBits2::eAllCommands
+      });
+    }
+  }
+  else
+    queue.tracking.onSubmit(trackingState); // handle error
 
   if (info)
   {
-    submitInfo.setWaitSemaphores(info->waitSemaphores);
-    submitInfo.setWaitDstStageMask(info->waitDstStageMask);
-    submitInfo.setSignalSemaphores(info->signalSemaphores);
-  } 
+    for (uint32_t i = 0; i < info->waitSemaphores.size(); i++)
+    {
+      auto stages = static_cast<VkPipelineStageFlags>(info->waitDstStageMask[i]);
+      waitInfos.push_back(vk::SemaphoreSubmitInfo {
+        .semaphore = info->waitSemaphores[i],
+        .stageMask = vk::PipelineStageFlags2(stages)
+      });
+    }
+
+    for (auto semaphore : info->signalSemaphores)
+    {
+      signalInfos.push_back(vk::SemaphoreSubmitInfo {
+        .semaphore = semaphore,
+        .stageMask = vk::PipelineStageFlagBits2::eAllCommands
+      });
+    }
+  }
+
+  cmdInfos.push_back(vk::CommandBufferSubmitInfo {
+    .commandBuffer = cmd.get()
+  });
+
+  vk::SubmitInfo2 submitInfo {};
+  submitInfo.setWaitSemaphoreInfos(waitInfos);
+  submitInfo.setCommandBufferInfos(cmdInfos);
+  submitInfo.setSignalSemaphoreInfos(signalInfos);
 
-  return etna::get_context().getQueue().submit({submitInfo}, signalFence);
+  return queue.queue.submit2({submitInfo}, signalFence);
 }
 
 } // namespace etna
\ No newline at end of file